@@ -0,0 +1,419 @@
+// End-to-end load generator: starts a server and a number of clients over
+// loopback, drives one traffic pattern for a while and reports throughput and
+// latency percentiles.
+//
+//   load_benchmark --pattern=pingpong --clients=16 --seconds=10 --size=256
+//
+// Patterns:
+//   pingpong   every client keeps --window requests in flight (default 1)
+//   stream     the same with a deep pipeline (--window defaults to 256)
+//   mixed      stream with 64 B / 1 KB / 64 KB messages (70/25/5 percent)
+//   rate       open loop, --rate messages per second spread over all clients
+//   broadcast  client 0 sends --rate messages per second, the server fans
+//              each one out to every client
+// Options: --clients --seconds --warmup --size --window --rate --io-threads
+//          --port --inline (handle on the I/O threads instead of Update)
+//          --trace=FILE (Chrome trace of the last messages, needs a build with
+//          NET_ENABLE_TRACING) --cork-bytes --cork-us --no-delay
+//          --unix=PATH (clients connect through a Unix domain socket)
+//          --shm=PATH (clients exchange messages through shared memory, set
+//          up over a Unix domain socket at PATH; Linux only) --shm-poll-us
+//          --publish (broadcast through Publish to a topic every client
+//          subscribed to, instead of SendAllClient) --publish-parallel
+//          (subscribers from which Publish fans out on every I/O thread)
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <random>
+#include <string>
+#include "net.h"
+
+// Set by benchmark/CMakeLists.txt.
+#if !defined(NET_BUILD_TYPE)
+#define NET_BUILD_TYPE "unknown"
+#endif
+
+enum class Op : uint32_t {
+  kEcho,
+  kBroadcast,
+  // last message of a client, echoed back so its receiver knows it is done
+  kFin,
+  kFinBroadcast,
+};
+
+using Clock = std::chrono::steady_clock;
+
+uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             Clock::now().time_since_epoch())
+      .count();
+}
+
+struct Options {
+  std::string pattern = "pingpong";
+  size_t clients = 8;
+  double seconds = 5;
+  double warmup = 1;
+  size_t size = 64;
+  size_t window = 0;
+  double rate = 10000;
+  size_t io_threads = 2;
+  uint16_t port = 60001;
+  bool inline_handlers = false;
+  std::string trace_path;
+  std::string unix_path;
+  std::string shm_path;
+  bool publish = false;
+  size_t publish_parallel = net::kDefaultPublishParallelThreshold;
+  // server and clients alike
+  net::ConnectionOptions connection;
+};
+
+// Everything the clients measure, recorded only while measuring is set.
+struct Results {
+  std::atomic<bool> measuring{false};
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> messages{0};
+  std::atomic<uint64_t> bytes{0};
+  net::Histogram latency;
+
+  void Record(const net::Message<Op>& msg) {
+    if (!measuring.load(std::memory_order_relaxed)) {
+      return;
+    }
+    uint64_t sent = 0;
+    std::memcpy(&sent, msg.body.data(), sizeof(sent));
+    latency.Record(NowNs() - sent);
+    messages.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(msg.entire_size(), std::memory_order_relaxed);
+  }
+};
+
+// The body starts with the time the message was (meant to be) sent.
+net::Message<Op> MakeMessage(Op op, size_t size, uint64_t sent) {
+  net::Message<Op> msg(op);
+  msg.body.resize(std::max(size, sizeof(sent)));
+  std::memset(msg.body.data(), 0, msg.body.size());
+  std::memcpy(msg.body.data(), &sent, sizeof(sent));
+  msg.header.data_size = static_cast<uint32_t>(msg.body.size());
+  return msg;
+}
+
+class BenchmarkServer : public net::ServerInterface<Op> {
+ public:
+  BenchmarkServer(const Options& options)
+      : net::ServerInterface<Op>(options.port, options.connection,
+                                 options.io_threads),
+        publish_(options.publish) {
+    SetPublishParallelThreshold(options.publish_parallel);
+    if (options.inline_handlers) {
+      auto echo = [](std::shared_ptr<net::Connection<Op>> client,
+                     net::Message<Op>& msg) { client->Send(std::move(msg)); };
+      auto broadcast = [this](std::shared_ptr<net::Connection<Op>>,
+                              net::Message<Op>& msg) {
+        Broadcast(std::move(msg));
+      };
+      RegisterHandler(Op::kEcho, echo);
+      RegisterHandler(Op::kFin, echo);
+      RegisterHandler(Op::kBroadcast, broadcast);
+      RegisterHandler(Op::kFinBroadcast, broadcast);
+    }
+  }
+
+ protected:
+  bool OnClientConnect(
+      std::shared_ptr<net::Connection<Op>> /*client*/) override {
+    return true;
+  }
+
+  void OnClientValidationSuccess(
+      std::shared_ptr<net::Connection<Op>> client) override {
+    if (publish_) {
+      Subscribe(client, kTopic);
+    }
+  }
+
+  void OnMessageArrive(std::shared_ptr<net::Connection<Op>> client,
+                       net::Message<Op>& msg) override {
+    switch (msg.header.op) {
+      case Op::kEcho:
+      case Op::kFin:
+        client->Send(std::move(msg));
+        break;
+      case Op::kBroadcast:
+      case Op::kFinBroadcast:
+        Broadcast(std::move(msg));
+        break;
+    }
+  }
+
+ private:
+  static constexpr const char* kTopic = "benchmark";
+
+  void Broadcast(net::Message<Op>&& msg) {
+    net::SharedMessage<Op> shared = net::MakeSharedMessage(std::move(msg));
+    if (publish_) {
+      Publish(kTopic, shared);
+    } else {
+      SendAllClient(shared);
+    }
+  }
+
+  bool publish_;
+};
+
+class BenchmarkClient : public net::ClientInterface<Op> {
+ public:
+  using net::ClientInterface<Op>::ClientInterface;
+
+  void Send(net::Message<Op>&& msg) { connection_->Send(std::move(msg)); }
+};
+
+// Sizes of the mixed pattern.
+size_t PickSize(std::mt19937& gen) {
+  uint32_t roll = gen() % 100;
+  if (roll < 70) {
+    return 64;
+  } else if (roll < 95) {
+    return 1024;
+  }
+  return 64 * 1024;
+}
+
+// Closed loop: keep window messages in flight, send a new one for every reply.
+void RunClosedLoop(BenchmarkClient& client, const Options& options,
+                   Results& results, size_t window, bool mixed) {
+  std::mt19937 gen(std::random_device{}());
+  auto next_size = [&]() { return mixed ? PickSize(gen) : options.size; };
+  for (size_t i = 0; i < window; i++) {
+    client.Send(MakeMessage(Op::kEcho, next_size(), NowNs()));
+  }
+
+  bool fin_sent = false;
+  while (true) {
+    client.IncomingQueue().wait_until_non_empty();
+    net::Message<Op> msg = client.IncomingQueue().pop_front().msg;
+    if (msg.header.op == Op::kFin) {
+      return;
+    }
+    results.Record(msg);
+    if (!results.stop) {
+      client.Send(MakeMessage(Op::kEcho, next_size(), NowNs()));
+    } else if (!fin_sent) {
+      // replies arrive in order, so kFin comes back after the rest
+      client.Send(MakeMessage(Op::kFin, 0, NowNs()));
+      fin_sent = true;
+    }
+  }
+}
+
+// Open loop: send at a fixed rate no matter how fast replies come back.
+// Latency is taken from the intended send time, so a stalled server shows up
+// in the percentiles instead of just slowing the sender down.
+void RunOpenLoop(BenchmarkClient& client, const Options& options,
+                 Results& results, double rate, Op op, Op fin) {
+  auto interval = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(1.0 / rate));
+  Clock::time_point next = Clock::now();
+  while (!results.stop) {
+    std::this_thread::sleep_until(next);
+    uint64_t intended = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            next.time_since_epoch())
+                            .count();
+    client.Send(MakeMessage(op, options.size, intended));
+    next += interval;
+  }
+  client.Send(MakeMessage(fin, 0, NowNs()));
+}
+
+void Receive(BenchmarkClient& client, Results& results, Op fin) {
+  while (true) {
+    client.IncomingQueue().wait_until_non_empty();
+    net::Message<Op> msg = client.IncomingQueue().pop_front().msg;
+    if (msg.header.op == fin) {
+      return;
+    }
+    results.Record(msg);
+  }
+}
+
+Options ParseOptions(int argc, char** argv) {
+  std::map<std::string, std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.rfind("--", 0) != 0) {
+      continue;
+    }
+    size_t eq = arg.find('=');
+    args[arg.substr(2, eq == std::string::npos ? eq : eq - 2)] =
+        eq == std::string::npos ? "1" : arg.substr(eq + 1);
+  }
+
+  Options options;
+  if (args.count("pattern")) options.pattern = args["pattern"];
+  if (args.count("clients")) options.clients = std::stoul(args["clients"]);
+  if (args.count("seconds")) options.seconds = std::stod(args["seconds"]);
+  if (args.count("warmup")) options.warmup = std::stod(args["warmup"]);
+  if (args.count("size")) options.size = std::stoul(args["size"]);
+  if (args.count("window")) options.window = std::stoul(args["window"]);
+  if (args.count("rate")) options.rate = std::stod(args["rate"]);
+  if (args.count("io-threads")) {
+    options.io_threads = std::stoul(args["io-threads"]);
+  }
+  if (args.count("port")) {
+    options.port = static_cast<uint16_t>(std::stoul(args["port"]));
+  }
+  options.inline_handlers = args.count("inline") > 0;
+  if (args.count("trace")) options.trace_path = args["trace"];
+  if (args.count("unix")) options.unix_path = args["unix"];
+  if (args.count("shm")) options.shm_path = args["shm"];
+  options.publish = args.count("publish") > 0;
+  if (args.count("publish-parallel")) {
+    options.publish_parallel = std::stoul(args["publish-parallel"]);
+  }
+  if (args.count("shm-poll-us")) {
+    options.connection.shared_memory_busy_poll =
+        std::chrono::microseconds(std::stoul(args["shm-poll-us"]));
+  }
+  if (args.count("cork-bytes")) {
+    options.connection.cork_bytes = std::stoul(args["cork-bytes"]);
+  }
+  if (args.count("cork-us")) {
+    options.connection.cork_delay =
+        std::chrono::microseconds(std::stoul(args["cork-us"]));
+  }
+  options.connection.no_delay = args.count("no-delay") > 0;
+  options.clients = std::max<size_t>(options.clients, 1);
+  return options;
+}
+
+int main(int argc, char** argv) {
+  Options options = ParseOptions(argc, argv);
+  const std::string& pattern = options.pattern;
+  if (pattern != "pingpong" && pattern != "stream" && pattern != "mixed" &&
+      pattern != "rate" && pattern != "broadcast") {
+    std::cerr << "unknown pattern " << pattern << '\n';
+    return 1;
+  }
+
+  BenchmarkServer server(options);
+  server.Start();
+  if (!options.unix_path.empty()) {
+    server.ListenLocal(options.unix_path);
+  }
+#if defined(NET_HAS_SHARED_MEMORY)
+  if (!options.shm_path.empty()) {
+    server.ListenSharedMemory(options.shm_path);
+  }
+#else
+  if (!options.shm_path.empty()) {
+    std::cerr << "shared memory is not supported on this platform\n";
+    return 1;
+  }
+#endif
+  std::thread update_thread([&server]() {
+    while (!server.IsStopped()) {
+      server.Update();
+    }
+  });
+  auto stop_server = [&server, &update_thread]() {
+    server.Stop();
+    update_thread.join();
+  };
+
+  std::vector<std::unique_ptr<BenchmarkClient>> clients;
+  for (size_t i = 0; i < options.clients; i++) {
+    clients.push_back(std::make_unique<BenchmarkClient>(options.connection));
+    bool connected = false;
+    if (!options.shm_path.empty()) {
+#if defined(NET_HAS_SHARED_MEMORY)
+      connected = clients.back()->ConnectSharedMemory(options.shm_path);
+#endif
+    } else if (!options.unix_path.empty()) {
+      connected = clients.back()->ConnectLocal(options.unix_path);
+    } else {
+      connected = clients.back()->Connect("127.0.0.1", options.port);
+    }
+    if (!connected) {
+      clients.clear();
+      stop_server();
+      return 1;
+    }
+  }
+  // let every handshake finish before the first message goes out
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  Results results;
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < options.clients; i++) {
+    BenchmarkClient& client = *clients[i];
+    if (pattern == "pingpong" || pattern == "stream" || pattern == "mixed") {
+      size_t window = options.window;
+      if (window == 0) {
+        window = pattern == "pingpong" ? 1 : 256;
+      }
+      threads.emplace_back([&, window]() {
+        RunClosedLoop(client, options, results, window, pattern == "mixed");
+      });
+    } else if (pattern == "rate") {
+      threads.emplace_back([&]() {
+        RunOpenLoop(client, options, results, options.rate / options.clients,
+                    Op::kEcho, Op::kFin);
+      });
+      threads.emplace_back([&]() { Receive(client, results, Op::kFin); });
+    } else {
+      if (i == 0) {
+        threads.emplace_back([&]() {
+          RunOpenLoop(client, options, results, options.rate, Op::kBroadcast,
+                      Op::kFinBroadcast);
+        });
+      }
+      threads.emplace_back(
+          [&]() { Receive(client, results, Op::kFinBroadcast); });
+    }
+  }
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(options.warmup));
+  results.measuring = true;
+  Clock::time_point start = Clock::now();
+  std::this_thread::sleep_for(std::chrono::duration<double>(options.seconds));
+  results.measuring = false;
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  results.stop = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  auto us = [](uint64_t ns) { return ns / 1000.0; };
+  std::cout << std::fixed << std::setprecision(1) << "\npattern=" << pattern
+            << " clients=" << options.clients
+            << " io_threads=" << options.io_threads
+            << " size=" << options.size
+            << " inline=" << options.inline_handlers
+            << " publish=" << options.publish
+            << " transport="
+            << (!options.shm_path.empty()    ? "shm"
+                : !options.unix_path.empty() ? "unix"
+                                             : "tcp")
+            << " build=" << NET_BUILD_TYPE << '\n'
+            << "msgs/s=" << results.messages / elapsed
+            << " MB/s=" << results.bytes / elapsed / (1024 * 1024) << '\n'
+            << "latency_us p50=" << us(results.latency.Percentile(50))
+            << " p99=" << us(results.latency.Percentile(99))
+            << " p99.9=" << us(results.latency.Percentile(99.9))
+            << " max=" << us(results.latency.Max())
+            << " mean=" << us(results.latency.Mean()) << std::endl;
+
+  if (!options.trace_path.empty()) {
+    if (!net::kTracingEnabled) {
+      std::cerr << "--trace needs a build with NET_ENABLE_TRACING\n";
+    } else if (!net::Tracer::Instance().WriteChromeTrace(options.trace_path)) {
+      std::cerr << "cannot write " << options.trace_path << '\n';
+    }
+  }
+
+  clients.clear();
+  stop_server();
+  return 0;
+}
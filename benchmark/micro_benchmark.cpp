@@ -0,0 +1,322 @@
+// Microbenchmarks of the building blocks: message encoding, the incoming
+// queues, OwnedMessage copies and the handshake. Every case runs
+// --repetitions times and reports the median, minimum and maximum time per
+// operation.
+//
+//   micro_benchmark --format=csv --repetitions=10 --filter=ts_queue
+//
+// Options: --format=text|csv|json --repetitions --filter (substring of the
+//          case name) --max-producers
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <string>
+#include "net.h"
+
+// Set by benchmark/CMakeLists.txt.
+#if !defined(NET_BUILD_TYPE)
+#define NET_BUILD_TYPE "unknown"
+#endif
+
+enum class Op : uint32_t { kData };
+
+using Clock = std::chrono::steady_clock;
+
+// Keep the compiler from dropping work whose result is never used.
+template <typename Value>
+void DoNotOptimize(Value& value) {
+#if defined(__GNUC__) || defined(__clang__)
+  asm volatile("" : : "r,m"(value) : "memory");
+#else
+  static volatile char sink;
+  sink = *reinterpret_cast<volatile char*>(&value);
+#endif
+}
+
+struct Result {
+  std::string name;
+  size_t operations = 0;
+  double median_ns = 0;
+  double min_ns = 0;
+  double max_ns = 0;
+};
+
+class Runner {
+ public:
+  Runner(size_t repetitions, std::string filter)
+      : repetitions_(std::max<size_t>(repetitions, 1)),
+        filter_(std::move(filter)) {}
+
+  // fn performs operations operations and returns the time it took, so
+  // setup and teardown can stay out of the measurement. One warm-up run is
+  // thrown away.
+  template <typename Fn>
+  void Run(const std::string& name, size_t operations, Fn&& fn) {
+    if (name.find(filter_) == std::string::npos) {
+      return;
+    }
+    fn(operations);
+    std::vector<double> samples;
+    for (size_t i = 0; i < repetitions_; i++) {
+      Clock::duration elapsed = fn(operations);
+      samples.push_back(
+          std::chrono::duration<double, std::nano>(elapsed).count() /
+          operations);
+    }
+    std::sort(samples.begin(), samples.end());
+
+    Result result;
+    result.name = name;
+    result.operations = operations;
+    result.median_ns = samples[samples.size() / 2];
+    result.min_ns = samples.front();
+    result.max_ns = samples.back();
+    results_.push_back(result);
+    std::cerr << name << " done\n";
+  }
+
+  void Print(const std::string& format) const {
+    std::cout << std::fixed << std::setprecision(2);
+    if (format == "csv") {
+      std::cout << "name,operations,repetitions,median_ns,min_ns,max_ns,"
+                   "build\n";
+      for (const Result& r : results_) {
+        std::cout << r.name << ',' << r.operations << ',' << repetitions_
+                  << ',' << r.median_ns << ',' << r.min_ns << ','
+                  << r.max_ns << ',' << NET_BUILD_TYPE << '\n';
+      }
+    } else if (format == "json") {
+      std::cout << "{\"build\": \"" << NET_BUILD_TYPE
+                << "\", \"repetitions\": " << repetitions_
+                << ", \"benchmarks\": [\n";
+      for (size_t i = 0; i < results_.size(); i++) {
+        const Result& r = results_[i];
+        std::cout << "  {\"name\": \"" << r.name
+                  << "\", \"operations\": " << r.operations
+                  << ", \"median_ns\": " << r.median_ns
+                  << ", \"min_ns\": " << r.min_ns
+                  << ", \"max_ns\": " << r.max_ns << '}'
+                  << (i + 1 < results_.size() ? ",\n" : "\n");
+      }
+      std::cout << "]}\n";
+    } else {
+      std::cout << "build=" << NET_BUILD_TYPE << '\n';
+      for (const Result& r : results_) {
+        std::cout << std::left << std::setw(40) << r.name << std::right
+                  << std::setw(12) << r.median_ns << " ns/op  (min "
+                  << r.min_ns << ", max " << r.max_ns << ")\n";
+      }
+    }
+  }
+
+ private:
+  size_t repetitions_;
+  std::string filter_;
+  std::vector<Result> results_;
+};
+
+struct Pod64 {
+  uint64_t values[8];
+};
+
+void RunMessageBenchmarks(Runner& runner) {
+  runner.Run("message_push_pop_u32", 1 << 20, [](size_t n) {
+    net::Message<Op> msg(Op::kData);
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < n; i++) {
+      uint32_t value = static_cast<uint32_t>(i);
+      msg << value;
+      msg >> value;
+      DoNotOptimize(value);
+    }
+    return Clock::now() - start;
+  });
+
+  runner.Run("message_push_pop_pod64", 1 << 20, [](size_t n) {
+    net::Message<Op> msg(Op::kData);
+    Pod64 pod{};
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < n; i++) {
+      pod.values[0] = i;
+      msg << pod;
+      msg >> pod;
+      DoNotOptimize(pod);
+    }
+    return Clock::now() - start;
+  });
+
+  // a fresh message per operation, as senders build them
+  for (size_t fields : {1, 16}) {
+    runner.Run("message_build_u64_x" + std::to_string(fields), 1 << 18,
+               [fields](size_t n) {
+                 Clock::time_point start = Clock::now();
+                 for (size_t i = 0; i < n; i++) {
+                   net::Message<Op> msg(Op::kData);
+                   for (size_t f = 0; f < fields; f++) {
+                     msg << static_cast<uint64_t>(i + f);
+                   }
+                   DoNotOptimize(msg);
+                 }
+                 return Clock::now() - start;
+               });
+  }
+
+  for (size_t length : {16, 256, 4096}) {
+    std::string str(length, 'x');
+    runner.Run("message_push_pop_string_" + std::to_string(length), 1 << 18,
+               [str](size_t n) {
+                 net::Message<Op> msg(Op::kData);
+                 std::string out;
+                 Clock::time_point start = Clock::now();
+                 for (size_t i = 0; i < n; i++) {
+                   msg << str;
+                   msg >> out;
+                   DoNotOptimize(out);
+                 }
+                 return Clock::now() - start;
+               });
+
+    runner.Run("builder_reader_string_" + std::to_string(length), 1 << 18,
+               [str](size_t n) {
+                 Clock::time_point start = Clock::now();
+                 for (size_t i = 0; i < n; i++) {
+                   net::Message<Op> msg =
+                       net::MessageBuilder<Op>::Make(Op::kData, str);
+                   net::MessageReader<Op> reader(msg);
+                   std::string_view out;
+                   reader >> out;
+                   DoNotOptimize(out);
+                 }
+                 return Clock::now() - start;
+               });
+  }
+}
+
+// producers threads push n items in total while this thread pops them.
+template <typename Queue>
+Clock::duration RunQueue(size_t producers, size_t n) {
+  Queue queue;
+  net::OwnedMessage<Op> item{nullptr, net::Message<Op>(Op::kData)};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+  size_t per_producer = n / producers;
+  for (size_t p = 0; p < producers; p++) {
+    threads.emplace_back([&]() {
+      while (!go) {
+      }
+      for (size_t i = 0; i < per_producer; i++) {
+        queue.push_back(item);
+      }
+    });
+  }
+
+  Clock::time_point start = Clock::now();
+  go = true;
+  for (size_t i = 0; i < per_producer * producers; i++) {
+    queue.wait_until_non_empty();
+    net::OwnedMessage<Op> popped = queue.pop_front();
+    DoNotOptimize(popped);
+  }
+  Clock::duration elapsed = Clock::now() - start;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return elapsed;
+}
+
+void RunQueueBenchmarks(Runner& runner, size_t max_producers) {
+  for (size_t producers = 1; producers <= max_producers; producers *= 2) {
+    runner.Run("ts_queue_producers_" + std::to_string(producers), 1 << 18,
+               [producers](size_t n) {
+                 return RunQueue<net::TsQueue<net::OwnedMessage<Op>>>(
+                     producers, n);
+               });
+    runner.Run("mpsc_queue_producers_" + std::to_string(producers), 1 << 18,
+               [producers](size_t n) {
+                 return RunQueue<net::MpscQueue<net::OwnedMessage<Op>>>(
+                     producers, n);
+               });
+  }
+
+  runner.Run("ts_queue_push_batch_64", 1 << 18, [](size_t n) {
+    net::TsQueue<net::OwnedMessage<Op>> queue;
+    std::vector<net::OwnedMessage<Op>> batch;
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < n; i += 64) {
+      for (size_t j = 0; j < 64; j++) {
+        batch.push_back({nullptr, net::Message<Op>(Op::kData)});
+      }
+      queue.push_batch(batch);
+      queue.drain(batch);
+      batch.clear();
+    }
+    return Clock::now() - start;
+  });
+}
+
+void RunOwnedMessageBenchmarks(Runner& runner) {
+  for (size_t size : {64, 4096}) {
+    net::OwnedMessage<Op> source{nullptr, net::Message<Op>(Op::kData)};
+    source.msg.body.resize(size);
+    source.msg.header.data_size = static_cast<uint32_t>(size);
+
+    runner.Run("owned_message_copy_" + std::to_string(size), 1 << 18,
+               [source](size_t n) {
+                 Clock::time_point start = Clock::now();
+                 for (size_t i = 0; i < n; i++) {
+                   net::OwnedMessage<Op> copy = source;
+                   DoNotOptimize(copy);
+                 }
+                 return Clock::now() - start;
+               });
+
+    runner.Run("owned_message_move_" + std::to_string(size), 1 << 18,
+               [source](size_t n) {
+                 net::OwnedMessage<Op> a = source;
+                 Clock::time_point start = Clock::now();
+                 for (size_t i = 0; i < n; i++) {
+                   net::OwnedMessage<Op> b = std::move(a);
+                   a = std::move(b);
+                   DoNotOptimize(a);
+                 }
+                 return Clock::now() - start;
+               });
+  }
+}
+
+void RunHandshakeBenchmarks(Runner& runner) {
+  runner.Run("handshake_scramble", 1 << 22, [](size_t n) {
+    uint64_t value = 0x0123456789abcdef;
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < n; i++) {
+      value = net::Connection<Op>::Scramble(value + i);
+      DoNotOptimize(value);
+    }
+    return Clock::now() - start;
+  });
+}
+
+int main(int argc, char** argv) {
+  std::map<std::string, std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    if (arg.rfind("--", 0) == 0 && eq != std::string::npos) {
+      args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+    }
+  }
+  std::string format = args.count("format") ? args["format"] : "text";
+  size_t repetitions =
+      args.count("repetitions") ? std::stoul(args["repetitions"]) : 10;
+  size_t max_producers = args.count("max-producers")
+                             ? std::stoul(args["max-producers"])
+                             : std::max(2u, std::thread::hardware_concurrency());
+
+  Runner runner(repetitions, args.count("filter") ? args["filter"] : "");
+  RunMessageBenchmarks(runner);
+  RunQueueBenchmarks(runner, max_producers);
+  RunOwnedMessageBenchmarks(runner);
+  RunHandshakeBenchmarks(runner);
+  runner.Print(format);
+  return 0;
+}
@@ -0,0 +1,60 @@
+#include "net_coroutine.h"
+enum Operation {
+  // [Client] Send a counter to the server.
+  // [Server] Echo the message back unchanged.
+  kEcho,
+};
+
+// Starts the echo server of the README on port 60000 and runs a coroutine
+// client against it that checks every echoed counter.
+int main(int argc, char* argv[]) {
+  int count = argc > 1 ? std::atoi(argv[1]) : 10000;
+
+  net::CoServer<Operation> server(
+      60000, [](std::shared_ptr<net::CoConnection<Operation>> client)
+                 -> asio::awaitable<void> {
+        net::Message<Operation> msg;
+        while (true) {
+          co_await client->Receive(msg);
+          co_await client->Send(msg);
+        }
+      });
+  server.Start();
+
+  int echoed = 0;
+  asio::io_context asio_context;
+  asio::co_spawn(
+      asio_context,
+      [&]() -> asio::awaitable<void> {
+        std::shared_ptr<net::CoConnection<Operation>> connection =
+            co_await net::CoConnect<Operation>("127.0.0.1", 60000);
+        net::Message<Operation> reply;
+        for (int i = 0; i < count; i++) {
+          net::Message<Operation> msg(Operation::kEcho);
+          msg << i;
+          co_await connection->Send(msg);
+          co_await connection->Receive(reply);
+          int value = -1;
+          reply >> value;
+          if (value != i) {
+            break;
+          }
+          echoed++;
+        }
+        connection->Close();
+      },
+      [](std::exception_ptr e) {
+        if (e) {
+          try {
+            std::rethrow_exception(e);
+          } catch (std::exception& error) {
+            std::cerr << "[Client] " << error.what() << '\n';
+          }
+        }
+      });
+  asio_context.run();
+
+  std::cout << "[Client] " << echoed << "/" << count << " echoed.\n";
+  server.Stop();
+  return echoed == count ? 0 : 1;
+}
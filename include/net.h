@@ -1,7 +1,22 @@
 #pragma once
+#include "net_buffer_pool.h"
 #include "net_common.h"
 #include "net_connection.h"
+#include "net_connection_registry.h"
+#include "net_context_pool.h"
+#include "net_coroutine.h"
+#include "net_datagram.h"
+#include "net_dispatch.h"
+#include "net_histogram.h"
 #include "net_message.h"
+#include "net_metrics.h"
+#include "net_mpsc_queue.h"
+#include "net_serialize.h"
+#include "net_shared_memory.h"
+#include "net_timing_wheel.h"
+#include "net_topic_registry.h"
+#include "net_trace.h"
 #include "net_ts_queue.h"
+#include "net_worker_pool.h"
 #include "net_server.h"
 #include "net_client.h"
\ No newline at end of file
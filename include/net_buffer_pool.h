@@ -0,0 +1,191 @@
+#pragma once
+#include "net_common.h"
+
+namespace net {
+// Size-classed pool for message bodies and queue nodes. Blocks are rounded up
+// to a power of two between kMinBlockSize and kMaxBlockSize and recycled
+// through a per-thread cache, which trades blocks with a global pool in
+// batches. Larger requests go straight to operator new.
+class BufferPool {
+ public:
+  static constexpr size_t kMinBlockSize = 64;
+  static constexpr size_t kClassCount = 11;
+  static constexpr size_t kMaxBlockSize = kMinBlockSize << (kClassCount - 1);
+  // bytes a thread cache may hold per size class before it gives half back
+  static constexpr size_t kThreadCacheBytes = 256 * 1024;
+  // blocks moved between a thread cache and the global pool at once
+  static constexpr size_t kTransferBatch = 32;
+
+  struct Stats {
+    // blocks that had to come from / went back to operator new / delete,
+    // once the pools are warm these stop growing
+    size_t system_allocations = 0;
+    size_t system_deallocations = 0;
+  };
+
+  static void* Allocate(size_t size) {
+    if (size > kMaxBlockSize) {
+      GetCounters().system_allocations.fetch_add(1, std::memory_order_relaxed);
+      return ::operator new(size);
+    }
+
+    size_t size_class = GetSizeClass(size);
+    ThreadCache* cache = GetThreadCache();
+    if (cache) {
+      std::vector<void*>& blocks = cache->blocks[size_class];
+      if (blocks.empty()) {
+        GetGlobalPool().Take(size_class, blocks);
+      }
+      if (!blocks.empty()) {
+        void* block = blocks.back();
+        blocks.pop_back();
+        return block;
+      }
+    }
+
+    GetCounters().system_allocations.fetch_add(1, std::memory_order_relaxed);
+    return ::operator new(kMinBlockSize << size_class);
+  }
+
+  static void Deallocate(void* block, size_t size) {
+    if (size > kMaxBlockSize) {
+      GetCounters().system_deallocations.fetch_add(1,
+                                                   std::memory_order_relaxed);
+      ::operator delete(block);
+      return;
+    }
+
+    size_t size_class = GetSizeClass(size);
+    ThreadCache* cache = GetThreadCache();
+    if (!cache) {
+      // the thread is exiting and its cache is already gone
+      GetGlobalPool().Give(size_class, &block, 1);
+      return;
+    }
+
+    std::vector<void*>& blocks = cache->blocks[size_class];
+    blocks.push_back(block);
+    if (blocks.size() > GetCacheLimit(size_class)) {
+      size_t count = blocks.size() / 2;
+      GetGlobalPool().Give(size_class, blocks.data() + blocks.size() - count,
+                           count);
+      blocks.resize(blocks.size() - count);
+    }
+  }
+
+  static Stats GetStats() {
+    Stats stats;
+    stats.system_allocations =
+        GetCounters().system_allocations.load(std::memory_order_relaxed);
+    stats.system_deallocations =
+        GetCounters().system_deallocations.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+ private:
+  struct Counters {
+    std::atomic<size_t> system_allocations{0};
+    std::atomic<size_t> system_deallocations{0};
+  };
+
+  class GlobalPool {
+   public:
+    // Move up to kTransferBatch blocks of size_class into out.
+    void Take(size_t size_class, std::vector<void*>& out) {
+      std::unique_lock<std::mutex> lock(mux_);
+      std::vector<void*>& blocks = blocks_[size_class];
+      size_t count = std::min(kTransferBatch, blocks.size());
+      out.insert(out.end(), blocks.end() - count, blocks.end());
+      blocks.resize(blocks.size() - count);
+    }
+
+    void Give(size_t size_class, void* const* blocks, size_t count) {
+      std::unique_lock<std::mutex> lock(mux_);
+      blocks_[size_class].insert(blocks_[size_class].end(), blocks,
+                                 blocks + count);
+    }
+
+   private:
+    std::mutex mux_;
+    std::vector<void*> blocks_[kClassCount];
+  };
+
+  struct ThreadCache {
+    ThreadCache() {
+      for (size_t i = 0; i < kClassCount; i++) {
+        blocks[i].reserve(GetCacheLimit(i) + 1);
+      }
+    }
+    ~ThreadCache() {
+      for (size_t i = 0; i < kClassCount; i++) {
+        GetGlobalPool().Give(i, blocks[i].data(), blocks[i].size());
+      }
+      GetThreadCacheDestroyed() = true;
+    }
+
+    std::vector<void*> blocks[kClassCount];
+  };
+
+  static size_t GetSizeClass(size_t size) {
+    size_t size_class = 0;
+    while ((kMinBlockSize << size_class) < size) {
+      size_class++;
+    }
+    return size_class;
+  }
+
+  static size_t GetCacheLimit(size_t size_class) {
+    return std::max<size_t>(kTransferBatch,
+                            kThreadCacheBytes / (kMinBlockSize << size_class));
+  }
+
+  static ThreadCache* GetThreadCache() {
+    if (GetThreadCacheDestroyed()) {
+      return nullptr;
+    }
+    static thread_local ThreadCache cache;
+    return &cache;
+  }
+
+  static bool& GetThreadCacheDestroyed() {
+    static thread_local bool destroyed = false;
+    return destroyed;
+  }
+
+  // Never destroyed, blocks may still be released by other static objects
+  // during shutdown.
+  static GlobalPool& GetGlobalPool() {
+    static GlobalPool* pool = new GlobalPool();
+    return *pool;
+  }
+
+  static Counters& GetCounters() {
+    static Counters* counters = new Counters();
+    return *counters;
+  }
+};
+
+// Allocator that draws from BufferPool, Message bodies use it.
+template <typename U>
+struct PoolAllocator {
+  using value_type = U;
+
+  PoolAllocator() = default;
+  template <typename V>
+  PoolAllocator(const PoolAllocator<V>&) {}
+
+  U* allocate(size_t n) {
+    return static_cast<U*>(BufferPool::Allocate(n * sizeof(U)));
+  }
+  void deallocate(U* p, size_t n) { BufferPool::Deallocate(p, n * sizeof(U)); }
+
+  template <typename V>
+  bool operator==(const PoolAllocator<V>&) const {
+    return true;
+  }
+  template <typename V>
+  bool operator!=(const PoolAllocator<V>&) const {
+    return false;
+  }
+};
+}  // namespace net
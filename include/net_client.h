@@ -1,4 +1,7 @@
 #pragma once
+#include <future>
+#include <optional>
+#include <unordered_map>
 #include "net_common.h"
 #include "net_connection.h"
 #include "net_message.h"
@@ -7,8 +10,14 @@ namespace net {
 template <typename T>
 class ClientInterface {
  public:
+  // a TCP or Unix domain endpoint
+  using Endpoint = typename Connection<T>::Socket::endpoint_type;
+
   // l Socket
-  ClientInterface() : socket_(asio_context_) {}
+  ClientInterface(const ConnectionOptions& options = {})
+      : socket_(asio_context_),
+        options_(options),
+        timing_wheel_(asio_context_, options.timer_tick) {}
   ~ClientInterface() { Disconnect(); }
   // ^Ǧ\Υ
   bool Connect(const std::string& host, const uint16_t port) {
@@ -22,32 +31,171 @@ class ClientInterface {
       // such as load balancing, support for multiple protocols (returning both
       // IPv4 and IPv6 addresses), among others.
       asio::ip::tcp::resolver resolver(asio_context_);
-      auto endpoints = resolver.resolve(host, std::to_string(port));
-      connection_ = std::make_unique<Connection<T>>(
-          Connection<T>::Owner::kClient, asio_context_,
-          asio::ip::tcp::socket(asio_context_), message_in_);
+      std::vector<Endpoint> endpoints;
+      for (const auto& entry : resolver.resolve(host, std::to_string(port))) {
+        endpoints.emplace_back(entry.endpoint());
+      }
+      Connect(endpoints);
+    } catch (std::exception& e) {
+      std::cerr << e.what() << '\n';
+      return false;
+    }
+    return true;
+  }
 
-      connection_->ConnectToServer(endpoints);
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  // Connect through the Unix domain socket a server on the same host listens
+  // on with ListenLocal.
+  bool ConnectLocal(const std::string& path) {
+    try {
+      Connect({asio::local::stream_protocol::endpoint(path)});
+    } catch (std::exception& e) {
+      std::cerr << e.what() << '\n';
+      return false;
+    }
+    return true;
+  }
+#endif
 
-      context_thread_ = std::thread([this]() { asio_context_.run(); });
+#if defined(NET_HAS_SHARED_MEMORY)
+  // Connect to a server on the same host listening with ListenSharedMemory,
+  // the messages then go through shared memory instead of the socket.
+  bool ConnectSharedMemory(const std::string& path) {
+    try {
+      Connect({asio::local::stream_protocol::endpoint(path)}, true);
     } catch (std::exception& e) {
       std::cerr << e.what() << '\n';
       return false;
     }
     return true;
   }
+#endif
+
+  // Register with the UDP port of a server that called ListenDatagrams once
+  // the TCP connection is validated, then send the messages with one of
+  // unreliable_ops as datagrams. Until the server has answered, and for
+  // messages too large for a datagram, they still go over TCP. Call it
+  // before Connect, it has no effect on Unix domain connections.
+  void UseDatagrams(uint16_t port, const std::vector<T>& unreliable_ops,
+                    size_t max_datagram_size = kDefaultMaxDatagramSize) {
+    datagram_port_ = port;
+    datagrams_ = std::make_unique<DatagramChannel<T>>(
+        asio_context_,
+        [this](const DatagramHeader& header) -> std::shared_ptr<Connection<T>> {
+          if (connection_ && connection_->GetDatagramToken() == header.token) {
+            return connection_;
+          }
+          return nullptr;
+        },
+        max_datagram_size);
+    for (T op : unreliable_ops) {
+      datagrams_->SetUnreliable(op);
+    }
+  }
+
+  DatagramStats GetDatagramStats() const {
+    return datagrams_ ? datagrams_->GetStats() : DatagramStats();
+  }
 
   void Disconnect() {
-    if (IsConnected()) {
+    if (connection_) {
       connection_->Disconnect();
     }
 
+    work_guard_.reset();
     asio_context_.stop();
     if (context_thread_.joinable()) {
       context_thread_.join();
     }
+    if (datagrams_) {
+      datagrams_->Close();
+    }
+
+    connection_.reset();
+    FailRequests(asio::error::operation_aborted);
+  }
+
+  using ResponseHandler =
+      std::function<void(system::error_code, Message<T>& response)>;
+
+  // Send msg as a request and call handler on the I/O thread with the reply
+  // the server sends through Reply. Any number of requests may be in flight,
+  // replies may come back in any order. A timeout other than zero fails the
+  // request with asio::error::timed_out if no reply arrived in time, closing
+  // the connection fails it with operation_aborted. Requests made while the
+  // client is still connecting are sent once it is validated. Without a
+  // connection there is no I/O thread, and handler runs right away on the
+  // calling thread with not_connected.
+  void Request(Message<T> msg, ResponseHandler handler,
+               std::chrono::milliseconds timeout = {}) {
+    if (!connection_) {
+      handler(asio::error::not_connected, msg);
+      return;
+    }
+    if (!request_handler_set_.exchange(true)) {
+      // responses to Request never reach message_in_. Installed before the
+      // first request is sent, so before any reply can arrive.
+      asio::dispatch(asio_context_, [this, connection = connection_]() {
+        connection->SetInlineHandler(
+            [this](std::shared_ptr<Connection<T>>, Message<T>& msg) {
+              return CompleteRequest(msg);
+            });
+      });
+    }
 
-    connection_.release();
+    uint64_t id = next_correlation_id_++;
+    msg.attach_correlation_id(id);
+    {
+      std::unique_lock<std::mutex> lock(requests_mux_);
+      PendingRequest& request = requests_[id];
+      request.handler = std::move(handler);
+      if (!connection_->IsOpen()) {
+        PostFailRequest(request, id, asio::error::not_connected);
+        return;
+      }
+      if (timeout.count() > 0) {
+        request.timer = std::make_unique<asio::steady_timer>(asio_context_);
+        request.timer->expires_after(timeout);
+        request.timer->async_wait([this, id](system::error_code ec) {
+          if (!ec) {
+            FailRequest(id, asio::error::timed_out);
+          }
+        });
+      }
+    }
+
+    SendStatus status = connection_->Send(std::move(msg));
+    if (status == SendStatus::kDropped ||
+        status == SendStatus::kDisconnected) {
+      std::unique_lock<std::mutex> lock(requests_mux_);
+      auto it = requests_.find(id);
+      if (it != requests_.end()) {
+        PostFailRequest(it->second, id,
+                        status == SendStatus::kDropped
+                            ? asio::error::no_buffer_space
+                            : asio::error::not_connected);
+      }
+    }
+  }
+
+  // Same as above, the future throws system::system_error if the request
+  // failed.
+  std::future<Message<T>> Request(Message<T> msg,
+                                  std::chrono::milliseconds timeout = {}) {
+    auto promise = std::make_shared<std::promise<Message<T>>>();
+    std::future<Message<T>> response = promise->get_future();
+    Request(
+        std::move(msg),
+        [promise](system::error_code ec, Message<T>& msg) {
+          if (ec) {
+            promise->set_exception(
+                std::make_exception_ptr(system::system_error(ec)));
+          } else {
+            promise->set_value(std::move(msg));
+          }
+        },
+        timeout);
+    return response;
   }
 
   bool IsConnected() {
@@ -58,7 +206,7 @@ class ClientInterface {
     }
   }
 
-  TsQueue<OwnedMessage<T>>& IncomingQueue() { return message_in_; }
+  IncomingMessageQueue<T>& IncomingQueue() { return message_in_; }
 
  protected:
   // asio context handle the data transfer
@@ -67,11 +215,140 @@ class ClientInterface {
   std::thread context_thread_;
 
   asio::ip::tcp::socket socket_;
-  std::unique_ptr<Connection<T>> connection_;
+  std::shared_ptr<Connection<T>> connection_;
+  ConnectionOptions options_;
+  // checks the timeouts of options_ and sends the heartbeats
+  TimingWheel timing_wheel_;
+  // keeps context_thread_ running until Disconnect, so handlers posted after
+  // the connection closed still run
+  std::optional<asio::executor_work_guard<asio::io_context::executor_type>>
+      work_guard_;
 
  private:
+  void Connect(const std::vector<Endpoint>& endpoints,
+               bool shared_memory = false) {
+    connection_ = std::make_shared<Connection<T>>(
+        Connection<T>::Owner::kClient, asio_context_,
+        typename Connection<T>::Socket(asio_context_), message_in_, options_);
+    // see Request
+    request_handler_set_ = false;
+#if defined(NET_HAS_SHARED_MEMORY)
+    if (shared_memory) {
+      connection_->UseSharedMemory();
+    }
+#endif
+    connection_->SetTimingWheel(&timing_wheel_);
+    if (datagrams_) {
+      connection_->SetDatagramChannel(datagrams_.get());
+      connection_->SetValidatedHandler(
+          [this](std::shared_ptr<Connection<T>> connection) {
+            OpenDatagrams(connection);
+          });
+    }
+
+    connection_->ConnectToServer(endpoints);
+
+    work_guard_.emplace(asio_context_.get_executor());
+    context_thread_ = std::thread([this]() { asio_context_.run(); });
+  }
+
+  // [I/O thread] Send the hello to the same host the TCP connection goes to.
+  void OpenDatagrams(const std::shared_ptr<Connection<T>>& connection) {
+    asio::ip::address address;
+    if (!connection->GetRemoteAddress(address)) {
+      return;
+    }
+    try {
+      datagrams_->Connect(asio::ip::udp::endpoint(address, datagram_port_),
+                          connection->GetDatagramToken());
+    } catch (std::exception& e) {
+      std::cerr << "[Client] Datagram Error: " << e.what() << '\n';
+    }
+  }
+
+  struct PendingRequest {
+    ResponseHandler handler;
+    std::unique_ptr<asio::steady_timer> timer;
+    // set once failing it has been posted, FailRequests reports it instead of
+    // its own error if the I/O thread stops first
+    system::error_code failure;
+  };
+
+  // Called with requests_mux_ held. Fails the request on the I/O thread
+  // rather than on the thread that made it.
+  void PostFailRequest(PendingRequest& request, uint64_t id,
+                       system::error_code ec) {
+    request.failure = ec;
+    asio::post(asio_context_, [this, id, ec]() { FailRequest(id, ec); });
+  }
+
+  // [I/O thread] True if msg answers a request, which then consumes it.
+  bool CompleteRequest(Message<T>& msg) {
+    if (msg.correlation_id == 0) {
+      return false;
+    }
+    PendingRequest request;
+    {
+      std::unique_lock<std::mutex> lock(requests_mux_);
+      auto it = requests_.find(msg.correlation_id);
+      if (it == requests_.end()) {
+        // it timed out already
+        return true;
+      }
+      request = std::move(it->second);
+      requests_.erase(it);
+      if (request.timer) {
+        request.timer->cancel();
+      }
+    }
+    request.handler(system::error_code(), msg);
+    return true;
+  }
+
+  void FailRequest(uint64_t id, system::error_code ec) {
+    PendingRequest request;
+    {
+      std::unique_lock<std::mutex> lock(requests_mux_);
+      auto it = requests_.find(id);
+      if (it == requests_.end()) {
+        return;
+      }
+      request = std::move(it->second);
+      requests_.erase(it);
+      if (request.timer) {
+        request.timer->cancel();
+      }
+    }
+    Message<T> empty;
+    request.handler(ec, empty);
+  }
+
+  // Only called once the I/O thread has stopped.
+  void FailRequests(system::error_code ec) {
+    std::unordered_map<uint64_t, PendingRequest> requests;
+    {
+      std::unique_lock<std::mutex> lock(requests_mux_);
+      requests.swap(requests_);
+    }
+    for (auto& [id, request] : requests) {
+      Message<T> empty;
+      request.handler(request.failure ? request.failure : ec, empty);
+    }
+  }
+
+  std::mutex requests_mux_;
+  std::unordered_map<uint64_t, PendingRequest> requests_;
+  // whether the connection already has CompleteRequest as inline handler
+  std::atomic<bool> request_handler_set_{false};
+  // 0 marks a message that is not part of a request
+  std::atomic<uint64_t> next_correlation_id_{1};
+
+  // see UseDatagrams
+  std::unique_ptr<DatagramChannel<T>> datagrams_;
+  uint16_t datagram_port_ = 0;
+
   // un Message<T> YiAFO Connection G@Pu
   // OwnedMessage
-  TsQueue<OwnedMessage<T>> message_in_;
+  IncomingMessageQueue<T> message_in_;
 };
 }  // namespace net
\ No newline at end of file
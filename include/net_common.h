@@ -1,11 +1,16 @@
 #pragma once
+#include <array>
+#include <cstring>
 #include <deque>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <mutex>
 #include <queue>
 #include <random>
+#include <string_view>
 #include <thread>
+#include <utility>
 #include <vector>
 #define BOOST_DISABLE_CURRENT_LOCATION
 #include <boost/asio.hpp>
@@ -1,12 +1,129 @@
 #pragma once
 #include "net_common.h"
+#include "net_datagram.h"
 #include "net_message.h"
+#include "net_metrics.h"
+#include "net_mpsc_queue.h"
+#include "net_shared_memory.h"
+#include "net_timing_wheel.h"
+#include "net_trace.h"
 #include "net_ts_queue.h"
 
 namespace net {
 template <typename T>
 class ServerInterface;
 
+// The queue every connection pushes its received messages into. Define
+// NET_LOCK_FREE_INCOMING_QUEUE to use the lock-free MpscQueue instead of
+// TsQueue, in which case only one thread may consume it.
+#ifdef NET_LOCK_FREE_INCOMING_QUEUE
+template <typename T>
+using IncomingMessageQueue = MpscQueue<OwnedMessage<T>>;
+#else
+template <typename T>
+using IncomingMessageQueue = TsQueue<OwnedMessage<T>>;
+#endif
+
+// Result of queuing an outgoing message.
+enum class SendStatus {
+  // queued below the high watermarks
+  kQueued,
+  // queued, but the outgoing queue is over a high watermark
+  kBackpressure,
+  // not queued, either the connection is closed or kDropNewest applied
+  kDropped,
+  // not queued, kDisconnect applied and the connection is being closed
+  kDisconnected,
+};
+
+struct ConnectionOptions {
+  enum class ReadMode {
+    // read every header and body with its own exact-size async_read
+    kExact,
+    // read as much as is available into a reusable buffer and parse every
+    // complete frame out of it, carrying partial frames over to the next read
+    kBuffered,
+  };
+
+  // What Send does with a message that takes the outgoing queue over a high
+  // watermark.
+  enum class OverflowPolicy {
+    // queue it anyway and only report kBackpressure
+    kNone,
+    // queue it and drop the oldest messages that are not being written yet
+    kDropOldest,
+    // do not queue it
+    kDropNewest,
+    // replace a queued message with the same op that is not being written yet
+    kCoalesce,
+    // close the connection
+    kDisconnect,
+  };
+
+  // Upper bound on the number of bytes gathered into a single write.
+  size_t max_write_bytes = 64 * 1024;
+  ReadMode read_mode = ReadMode::kExact;
+  // Initial size of the kBuffered receive buffer, it grows to fit any frame
+  // that is larger.
+  size_t read_buffer_size = 64 * 1024;
+
+  // Outgoing queue watermarks, 0 disables a limit. Going over either high
+  // watermark applies overflow_policy, the connection becomes writable again
+  // once the queue has drained to both low watermarks.
+  size_t high_watermark_bytes = 0;
+  size_t low_watermark_bytes = 0;
+  size_t high_watermark_messages = 0;
+  size_t low_watermark_messages = 0;
+  OverflowPolicy overflow_policy = OverflowPolicy::kNone;
+
+  // Corking holds sent messages back and writes them together. They go out
+  // once cork_bytes are queued, cork_delay has passed since the first of
+  // them was held, or Flush is called (ServerInterface::Update flushes the
+  // senders of each batch it handled). 0 disables either trigger, corking is
+  // off when both are 0.
+  size_t cork_bytes = 0;
+  std::chrono::microseconds cork_delay{0};
+
+  // Socket options, applied once the socket is connected. A buffer size of
+  // 0 keeps the system default.
+  bool no_delay = false;
+  bool keep_alive = false;
+  int send_buffer_size = 0;
+  int receive_buffer_size = 0;
+
+  // Shared memory transport: size of the ring in each direction (rounded up
+  // to a power of two), and how long a receiver keeps polling an empty ring
+  // before it sleeps on its eventfd. Polling keeps the I/O thread busy but
+  // saves the wakeup.
+  size_t shared_memory_ring_bytes = 1 << 20;
+  std::chrono::microseconds shared_memory_busy_poll{0};
+
+  // Timeouts, 0 disables each one. A connection that runs into one is closed
+  // with DisconnectReason::kTimeout. They are checked on the timing wheel of
+  // the connection's I/O thread, so they may expire up to two ticks late.
+  // handshake_timeout runs from connecting until the handshake succeeded,
+  // the others once it has: idle_timeout while nothing is read or written,
+  // read_timeout while nothing is read (heartbeats count) and write_timeout
+  // while a write makes no progress.
+  std::chrono::milliseconds handshake_timeout{0};
+  std::chrono::milliseconds idle_timeout{0};
+  std::chrono::milliseconds read_timeout{0};
+  std::chrono::milliseconds write_timeout{0};
+  // Send a heartbeat frame whenever nothing was written for this long, so
+  // the peer's read and idle timeouts only catch connections that are dead.
+  // 0 sends none.
+  std::chrono::milliseconds heartbeat_interval{0};
+  // Resolution of the timing wheels the server and the client create.
+  std::chrono::milliseconds timer_tick{100};
+
+  bool IsCorked() const { return cork_bytes > 0 || cork_delay.count() > 0; }
+  bool HasTimers() const {
+    return handshake_timeout.count() > 0 || idle_timeout.count() > 0 ||
+           read_timeout.count() > 0 || write_timeout.count() > 0 ||
+           heartbeat_interval.count() > 0;
+  }
+};
+
 template <typename T>
 class Connection : public std::enable_shared_from_this<Connection<T>> {
  public:
@@ -15,32 +132,56 @@ class Connection : public std::enable_shared_from_this<Connection<T>> {
     kClient,
   };
 
-  Connection(Owner Owner, asio::io_context& asio_context,
-             asio::ip::tcp::socket&& socket,
-             TsQueue<OwnedMessage<T>>& message_in)
+  // Holds a TCP or a Unix domain socket alike, the framing and handshake do
+  // not depend on the transport.
+  using Socket = asio::generic::stream_protocol::socket;
+
+  Connection(Owner Owner, asio::io_context& asio_context, Socket&& socket,
+             IncomingMessageQueue<T>& message_in,
+             const ConnectionOptions& options = {})
       : owner_(Owner),
         asio_context_(asio_context),
         socket_(std::move(socket)),
-        message_in_(message_in) {}
+        message_in_(message_in),
+        options_(options),
+        cork_timer_(asio_context) {
+    // an accepted socket is connected already, a client's one once
+    // ConnectToServer succeeds
+    established_ = socket_.is_open();
+  }
 
-  virtual ~Connection() { Disconnect(); }
+  // Every pending handler holds a reference to the connection, so once the
+  // last one is gone nothing can touch the socket any more and it is simply
+  // closed by its destructor.
+  virtual ~Connection() = default;
 
   // [Client] Connect to server and call ReadValidation to validate that this
-  // connection is legitimate
-  void ConnectToServer(asio::ip::tcp::resolver::results_type& endpoints) {
+  // connection is legitimate. endpoints may be TCP or Unix domain ones, they
+  // are tried in order.
+  void ConnectToServer(const std::vector<Socket::endpoint_type>& endpoints) {
     if (owner_ == Owner::kClient) {
+      PostStartTimers();
       asio::async_connect(
           socket_, endpoints,
-          [this](system::error_code ec, asio::ip::tcp::endpoint endpoint) {
+          [this, self = this->shared_from_this()](
+              system::error_code ec, Socket::endpoint_type /*endpoint*/) {
             if (!ec) {
               std::cout << "[Client] Connect Success.\n";
+              established_ = true;
+              ApplySocketOptions();
+#if defined(NET_HAS_SHARED_MEMORY)
+              if (use_shared_memory_) {
+                ReceiveSharedMemory();
+                return;
+              }
+#endif
               ReadValidation();
             } else if (ec == asio::error::eof) {
               std::cout << "[" << id_ << "] socket has been terminated\n";
-              socket_.close();
+              Close(DisconnectReason::kPeerClosed);
             } else {
               std::cerr << "[Client] Connect Failed.\n";
-              socket_.close();
+              Close(DisconnectReason::kConnectFailed);
             }
           });
     }
@@ -56,9 +197,19 @@ class Connection : public std::enable_shared_from_this<Connection<T>> {
         std::uniform_int_distribution<int64_t> dis(
             std::numeric_limits<int64_t>::min(),
             std::numeric_limits<int64_t>::max());
-        handshake_out_ = dis(gen);
+        // 0 would match datagrams that carry no token
+        do {
+          handshake_out_ = dis(gen);
+        } while (handshake_out_ == 0);
         handshake_check_ = Scramble(handshake_out_);
         id_ = uid;
+        PostStartTimers();
+        ApplySocketOptions();
+#if defined(NET_HAS_SHARED_MEMORY)
+        if (use_shared_memory_ && !SendSharedMemory()) {
+          return;
+        }
+#endif
         WriteValidation();
       }
     }
@@ -66,39 +217,293 @@ class Connection : public std::enable_shared_from_this<Connection<T>> {
 
   uint32_t GetID() { return id_; }
 
-  asio::ip::tcp::socket& GetSocket() { return socket_; }
+  Owner GetOwner() const { return owner_; }
+
+  // The context that runs every handler of this connection.
+  asio::io_context& GetContext() { return asio_context_; }
+
+  // [Client, Server] Send the ops channel marks unreliable as datagrams once
+  // the client has registered with it, see DatagramChannel. Call it before
+  // ConnectToServer or ConnectToClient.
+  void SetDatagramChannel(DatagramChannel<T>* channel) { datagram_ = channel; }
+
+  // [Client, Server] Check the timeouts and send the heartbeats of options
+  // on wheel, which must run on the context of this connection. Ignored if
+  // options set none. Call it before ConnectToServer or ConnectToClient.
+  void SetTimingWheel(TimingWheel* wheel) {
+    if (options_.HasTimers()) {
+      timing_wheel_ = wheel;
+    }
+  }
+
+  // [Client, Server] The handshake value the server sent, which proves that
+  // a datagram comes from the other end of this connection.
+  uint64_t GetDatagramToken() const {
+    return owner_ == Owner::kServer ? handshake_out_ : handshake_in_;
+  }
+
+  DatagramPeer& GetDatagramPeer() { return datagram_peer_; }
+
+  // [Client, Server] Take a message that arrived as a datagram like one read
+  // from the socket: counted, traced, and handled inline or queued on the
+  // thread of this connection. Called on the thread of the datagram channel.
+  void ReceiveDatagram(Message<T>&& msg) {
+    auto receive = [this](Message<T>& msg) {
+      if constexpr (kTracingEnabled) {
+        TraceMessage(TracePoint::kHeaderRead, metrics_.messages_in.Get());
+      }
+      AddToIncomingMessageQueue(msg);
+    };
+    if (asio_context_.get_executor().running_in_this_thread()) {
+      receive(msg);
+    } else {
+      asio::post(asio_context_, [self = this->shared_from_this(), receive,
+                                 msg = std::move(msg)]() mutable {
+        receive(msg);
+      });
+    }
+  }
+
+#if defined(NET_HAS_SHARED_MEMORY)
+  // [Client, Server] Carry the messages through a pair of shared memory rings
+  // instead of the socket, which must be a Unix domain one. The server sets
+  // the rings up and passes them over the socket before the handshake, the
+  // socket then only tells either side when the other one went away. Call it
+  // before ConnectToServer or ConnectToClient.
+  void UseSharedMemory() { use_shared_memory_ = true; }
+#endif
+
+  // The answer a client must send back for a handshake value, shared with
+  // the coroutine connections. It mixes in the protocol version, version 1
+  // gives the answer older builds expect.
+  static uint64_t Scramble(uint64_t input) {
+    uint64_t out = input ^ 0xdeadbeefdeadbeef;
+    out = (out & 0xf0f0f0f0f0f0f0) >> 4 | (out & 0xf0f0f0f0f0f0f0) << 4;
+    return out ^ 0xbeef12345678dead ^
+           ((MessageHeader<T>::kProtocolVersion - 1) << 32);
+  }
+
+  Socket& GetSocket() { return socket_; }
+
+  // [Client, Server] "address:port" of a TCP peer, "unix:path" of a Unix
+  // domain one (the path of a client socket is usually empty).
+  std::string RemoteEndpoint() const {
+    system::error_code ec;
+    Socket::endpoint_type endpoint = socket_.remote_endpoint(ec);
+    if (ec) {
+      return "unknown";
+    }
+    std::ostringstream out;
+    if (IsIpFamily(endpoint.protocol().family())) {
+      asio::ip::tcp::endpoint ip_endpoint;
+      std::memcpy(ip_endpoint.data(), endpoint.data(), endpoint.size());
+      out << ip_endpoint;
+    } else {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+      asio::local::stream_protocol::endpoint local_endpoint;
+      std::memcpy(local_endpoint.data(), endpoint.data(), endpoint.size());
+      local_endpoint.resize(endpoint.size());
+      out << "unix:" << local_endpoint.path();
+#endif
+    }
+    return out.str();
+  }
+
+  // [Client, Server] Address of a TCP peer, false for a Unix domain one.
+  bool GetRemoteAddress(asio::ip::address& address) const {
+    system::error_code ec;
+    Socket::endpoint_type endpoint = socket_.remote_endpoint(ec);
+    if (ec || !IsIpFamily(endpoint.protocol().family())) {
+      return false;
+    }
+    asio::ip::tcp::endpoint ip_endpoint;
+    std::memcpy(ip_endpoint.data(), endpoint.data(), endpoint.size());
+    address = ip_endpoint.address();
+    return true;
+  }
 
   // [Client, Server]
-  void Disconnect() {
-    if (IsConnected()) asio::post(asio_context_, [this]() { socket_.close(); });
+  void Disconnect(DisconnectReason reason = DisconnectReason::kLocal) {
+    if (IsOpen()) {
+      asio::post(asio_context_, [this, self = this->shared_from_this(),
+                                 reason]() { Close(reason); });
+    }
+  }
+
+  // [Client, Server] True once the socket is connected and until the
+  // connection has been closed, safe to call from any thread.
+  bool IsConnected() const { return established_ && !closed_; }
+
+  // [Client, Server] False as soon as the connection has been closed, but
+  // unlike IsConnected already true while a client is still connecting.
+  // Messages sent meanwhile wait for the handshake.
+  bool IsOpen() const { return !closed_; }
+
+  // [Client, Server] Called once on the connection's I/O thread when it
+  // closes, whatever the reason.
+  void SetCloseHandler(
+      std::function<void(std::shared_ptr<Connection<T>>)> handler) {
+    on_close_ = std::move(handler);
+  }
+
+  // [Client, Server] Called once on the I/O thread when the handshake has
+  // succeeded.
+  void SetValidatedHandler(
+      std::function<void(std::shared_ptr<Connection<T>>)> handler) {
+    on_validated_ = std::move(handler);
+  }
+
+  // [Client, Server] Counters of this connection, safe to call from any
+  // thread.
+  ConnectionStats GetStats() const {
+    ConnectionStats stats;
+    stats.bytes_in = metrics_.bytes_in.Get();
+    stats.messages_in = metrics_.messages_in.Get();
+    stats.bytes_out = metrics_.bytes_out.Get();
+    stats.messages_out = metrics_.messages_out.Get();
+    stats.queued_bytes = queued_bytes_;
+    stats.queued_messages = queued_messages_;
+    stats.disconnect_reason = GetDisconnectReason();
+    return stats;
+  }
+
+  // [Client, Server] kNone while the connection is open.
+  DisconnectReason GetDisconnectReason() const { return disconnect_reason_; }
+
+  // [Client, Server] Called on the I/O thread for every decoded message
+  // before it is queued. Returning true consumes the message, false queues it
+  // as usual. Set it before the connection starts reading or from its I/O
+  // thread.
+  void SetInlineHandler(std::function<bool(std::shared_ptr<Connection<T>>,
+                                           Message<T>&)>
+                            handler) {
+    on_message_ = std::move(handler);
   }
 
   // [Client, Server]
-  bool IsConnected() const { return socket_.is_open(); }
+  SendStatus Send(const Message<T>& msg) {
+    return Send(MakeSharedMessage(msg));
+  }
 
   // [Client, Server]
-  void Send(const Message<T>& msg) {
-    asio::post(asio_context_, [this, msg]() {
-      // If the queue has a message in it, then we must
-      // assume that it is in the process of asynchronously being written.
-      // Either way add the message to the queue to be output. If no messages
-      // were available to be written, then start the process of writing the
-      // message at the front of the queue.
-      bool writing_msg = !message_out_.empty();
-      message_out_.push_back(msg);
-      if (!writing_msg) {
-        WriteHeader();
+  SendStatus Send(Message<T>&& msg) {
+    return Send(MakeSharedMessage(std::move(msg)));
+  }
+
+  // [Client, Server] The message is queued by reference, so the same
+  // SharedMessage can be sent to many connections without copying its body.
+  SendStatus Send(SharedMessage<T> msg) {
+    if (!IsOpen()) {
+      return SendStatus::kDropped;
+    }
+    if (datagram_ != nullptr && datagram_->IsUnreliable(msg->header.op) &&
+        datagram_->Send(datagram_peer_, *msg)) {
+      return SendStatus::kQueued;
+    }
+
+    size_t msg_size = msg->header_size() + msg->data_size();
+    bool overflow = OverHighWatermark(queued_bytes_ + msg_size,
+                                      queued_messages_ + 1);
+    SendStatus status = SendStatus::kQueued;
+    if (overflow) {
+      backpressured_ = true;
+      if (options_.overflow_policy ==
+          ConnectionOptions::OverflowPolicy::kDropNewest) {
+        return SendStatus::kDropped;
+      } else if (options_.overflow_policy ==
+                 ConnectionOptions::OverflowPolicy::kDisconnect) {
+        Disconnect(DisconnectReason::kOverflow);
+        return SendStatus::kDisconnected;
+      }
+      status = SendStatus::kBackpressure;
+    }
+    queued_bytes_ += msg_size;
+    queued_messages_++;
+
+    if (asio_context_.get_executor().running_in_this_thread()) {
+      // already on the I/O thread, like a task Publish posted: a second hop
+      // would let messages posted in the meantime overtake this one
+      EnqueueOnContext(std::move(msg), overflow);
+    } else {
+      asio::post(asio_context_, [this, self = this->shared_from_this(),
+                                 msg = std::move(msg), overflow]() mutable {
+        EnqueueOnContext(std::move(msg), overflow);
+      });
+    }
+    return status;
+  }
+
+  // [Client, Server] Write the messages held back by corking now, safe to
+  // call from any thread. Calls made while an earlier one is still pending
+  // are merged into it.
+  void Flush() {
+    if (!options_.IsCorked() || !IsOpen() ||
+        flush_pending_.exchange(true)) {
+      return;
+    }
+    asio::post(asio_context_, [this, self = this->shared_from_this()]() {
+      flush_pending_ = false;
+      if (validated_ && !writing_ && !message_out_.empty()) {
+        WriteMessages();
       }
     });
   }
 
+  // [Client, Server] Called on the connection's I/O thread once a
+  // backpressured outgoing queue has drained to the low watermarks.
+  void SetWritableHandler(
+      std::function<void(std::shared_ptr<Connection<T>>)> handler) {
+    on_writable_ = std::move(handler);
+  }
+
+  // [Client, Server]
+  bool IsBackpressured() const { return backpressured_; }
+
+  // [Client, Server] Bytes and messages queued but not yet written.
+  size_t GetQueuedBytes() const { return queued_bytes_; }
+  size_t GetQueuedMessages() const { return queued_messages_; }
+
  private:
+  // [Client, Server]
+  void StartReading() {
+#if defined(NET_HAS_SHARED_MEMORY)
+    if (shared_memory_) {
+      read_buffer_.resize(std::max(options_.read_buffer_size,
+                                   sizeof(MessageHeader<T>)));
+      read_end_ = 0;
+      ReceiveFromRing();
+      WatchSocket();
+      return;
+    }
+#endif
+    if (options_.read_mode == ConnectionOptions::ReadMode::kBuffered) {
+      read_buffer_.resize(std::max(options_.read_buffer_size,
+                                   sizeof(MessageHeader<T>)));
+      read_end_ = 0;
+      ReadSome();
+    } else {
+      ReadHeader();
+    }
+  }
+
   // [Client, Server]
   void ReadHeader() {
     asio::async_read(
         socket_, asio::buffer(&temp_msg_.header, sizeof(MessageHeader<T>)),
-        [this](system::error_code ec, std::size_t length) {
+        [this, self = this->shared_from_this()](system::error_code ec,
+                                                std::size_t /*length*/) {
           if (!ec) {
+            MarkRead();
+            if (temp_msg_.header.data_size ==
+                MessageHeader<T>::kHeartbeatFlag) {
+              metrics_.bytes_in.Add(sizeof(MessageHeader<T>));
+              ReadHeader();
+              return;
+            }
+            if constexpr (kTracingEnabled) {
+              TraceMessage(TracePoint::kHeaderRead,
+                           metrics_.messages_in.Get());
+            }
             if (temp_msg_.data_size() > 0) {
               temp_msg_.body.resize(temp_msg_.data_size());
               ReadBody();
@@ -107,10 +512,10 @@ class Connection : public std::enable_shared_from_this<Connection<T>> {
             }
           } else if (ec == asio::error::eof) {
             std::cout << "[" << id_ << "] socket has been terminated\n";
-            socket_.close();
+            Close(DisconnectReason::kPeerClosed);
           } else {
             std::cerr << "[" << id_ << "] async_read error.\n";
-            socket_.close();
+            Close(DisconnectReason::kReadError);
           }
         });
   }
@@ -119,119 +524,778 @@ class Connection : public std::enable_shared_from_this<Connection<T>> {
   void ReadBody() {
     asio::async_read(
         socket_, asio::buffer(temp_msg_.data_addr(), temp_msg_.data_size()),
-        [this](system::error_code ec, std::size_t length) {
+        [this, self = this->shared_from_this()](system::error_code ec,
+                                                std::size_t /*length*/) {
           if (!ec) {
+            MarkRead();
             AddToIncomingMessageQueue();
           } else if (ec == asio::error::eof) {
             std::cout << "[" << id_ << "] socket has been terminated\n";
-            socket_.close();
+            Close(DisconnectReason::kPeerClosed);
           } else {
             std::cerr << "[" << id_ << "] async_read error.\n";
-            socket_.close();
+            Close(DisconnectReason::kReadError);
           }
         });
   }
 
-  // [Client, Server]
-  void WriteHeader() {
-    Message<T>& msg = message_out_.front();
+  // [Client, Server] Gather as many queued messages as fit into the write
+  // budget (headers and bodies interleaved) and hand them to a single
+  // async_write. A message larger than the budget is still sent on its own.
+  void WriteMessages() {
+    writing_ = true;
+    MarkWritten();
+    if (cork_timer_armed_) {
+      cork_timer_armed_ = false;
+      cork_timer_.cancel();
+    }
+#if defined(NET_HAS_SHARED_MEMORY)
+    if (shared_memory_) {
+      WriteToRing();
+      return;
+    }
+#endif
+    write_buffers_.clear();
+    write_count_ = 0;
+    size_t write_bytes = 0;
+    for (const SharedMessage<T>& msg : message_out_) {
+      size_t msg_size = msg->header_size() + msg->data_size();
+      if (write_count_ > 0 &&
+          write_bytes + msg_size > options_.max_write_bytes) {
+        break;
+      }
+      write_buffers_.push_back(asio::buffer(&msg->header, msg->header_size()));
+      if (msg->data_size() > 0) {
+        write_buffers_.push_back(
+            asio::buffer(msg->body.data(), msg->data_size()));
+      }
+      write_bytes += msg_size;
+      write_count_++;
+    }
+
     asio::async_write(
-        socket_, asio::buffer(msg.header_addr(), msg.header_size()),
-        [this](system::error_code ec, std::size_t length) {
+        socket_, write_buffers_,
+        // called after every partial write, so write_timeout only catches a
+        // write that stopped moving, not one that is merely large
+        [this](const system::error_code& ec, std::size_t transferred) {
+          MarkWritten();
+          return asio::transfer_all()(ec, transferred);
+        },
+        [this, self = this->shared_from_this()](system::error_code ec,
+                                                std::size_t length) {
           if (!ec) {
-            if (message_out_.front().data_size() > 0) {
-              WriteBody();
-            } else {
-              message_out_.pop_front();
-              if (!message_out_.empty()) {
-                WriteHeader();
-              }
+            CompleteWrite(length, write_count_);
+            if (!message_out_.empty()) {
+              WriteMessages();
             }
           } else if (ec == asio::error::eof) {
             std::cout << "[" << id_ << "] socket has been terminated\n";
-            socket_.close();
+            Close(DisconnectReason::kPeerClosed);
           } else {
-            // Write Message Header Fail
-            std::cout << "[" << id_ << "] Write Message Header Failed.\n";
-            socket_.close();
+            std::cout << "[" << id_ << "] Write Messages Failed.\n";
+            Close(DisconnectReason::kWriteError);
           }
         });
   }
 
-  // [Client, Server]
-  void WriteBody() {
-    asio::async_write(
-        socket_,
-        asio::buffer((void*)message_out_.front().data_addr(),
-                     message_out_.front().data_size()),
-        [this](system::error_code ec, std::size_t length) {
+  // [Client, Server] Add the message to the queue to be output. If no write
+  // is in flight and the queue is not corked, start writing it.
+  void EnqueueOnContext(SharedMessage<T> msg, bool overflow) {
+    // the messages of the write in flight must stay where they are
+    size_t first_pending = writing_ ? write_count_ : 0;
+    if (overflow && options_.overflow_policy ==
+                        ConnectionOptions::OverflowPolicy::kCoalesce) {
+      for (size_t i = first_pending; i < message_out_.size(); i++) {
+        if (message_out_[i]->header.op == msg->header.op) {
+          SubtractQueued(*message_out_[i]);
+          message_out_[i] = std::move(msg);
+          return;
+        }
+      }
+    }
+
+    message_out_.push_back(std::move(msg));
+    if (overflow && options_.overflow_policy ==
+                        ConnectionOptions::OverflowPolicy::kDropOldest) {
+      while (message_out_.size() > first_pending + 1 &&
+             OverHighWatermark(queued_bytes_, queued_messages_)) {
+        SubtractQueued(*message_out_[first_pending]);
+        message_out_.erase(message_out_.begin() + first_pending);
+      }
+    }
+
+    WriteOrCork();
+  }
+
+  // [Client, Server] Account for the first count messages of message_out_
+  // having been written and drop them.
+  void CompleteWrite(size_t bytes, size_t count) {
+    if (bytes > 0) {
+      MarkWritten();
+    }
+    if constexpr (kTracingEnabled) {
+      // like TraceMessage, server connections only
+      uint64_t sent = metrics_.messages_out.Get();
+      for (size_t i = 0; i < count && owner_ == Owner::kServer; i++) {
+        const std::optional<uint64_t>& request_id = message_out_[i]->trace_id;
+        if (request_id) {
+          Trace(TracePoint::kReplyWritten, *request_id);
+        } else {
+          Trace(TracePoint::kWritten, MakeOutgoingTraceId(id_, sent + i));
+        }
+      }
+    }
+    metrics_.bytes_out.Add(bytes);
+    metrics_.messages_out.Add(count);
+    for (size_t i = 0; i < count; i++) {
+      SubtractQueued(*message_out_[i]);
+    }
+    message_out_.erase(message_out_.begin(), message_out_.begin() + count);
+    writing_ = false;
+    if (backpressured_ && BelowLowWatermark()) {
+      backpressured_ = false;
+      if (on_writable_) {
+        // posted, a Send from the handler would otherwise start a write
+        // while the caller is still busy with this one
+        asio::post(asio_context_, [this, self = this->shared_from_this()]() {
+          on_writable_(self);
+        });
+      }
+    }
+  }
+
+#if defined(NET_HAS_SHARED_MEMORY)
+  // [Server] Set the rings up and pass them to the client, false if that
+  // failed and the connection has been closed.
+  bool SendSharedMemory() {
+    system::error_code ec;
+    shared_memory_ = SharedMemoryChannel::Create(
+        options_.shared_memory_ring_bytes, ec);
+    if (shared_memory_) {
+      shared_memory_->SendTo(socket_.native_handle(), ec);
+    }
+    if (ec) {
+      std::cerr << "[" << id_ << "] shared memory error: " << ec.message()
+                << '\n';
+      Close(DisconnectReason::kHandshakeFailed);
+      return false;
+    }
+    shared_memory_event_ = std::make_unique<asio::posix::stream_descriptor>(
+        asio_context_, shared_memory_->ReleaseOwnEventFd());
+    return true;
+  }
+
+  // [Client] Take the rings the server passes before the handshake.
+  void ReceiveSharedMemory() {
+    socket_.async_wait(
+        Socket::wait_read,
+        [this, self = this->shared_from_this()](system::error_code ec) {
           if (!ec) {
-            message_out_.pop_front();
-            if (!message_out_.empty()) {
-              WriteHeader();
-            }
+            shared_memory_ = SharedMemoryChannel::ReceiveFrom(
+                socket_.native_handle(), ec);
+          }
+          if (ec) {
+            std::cerr << "[Client] shared memory error: " << ec.message()
+                      << '\n';
+            Close(DisconnectReason::kHandshakeFailed);
+            return;
+          }
+          shared_memory_event_ =
+              std::make_unique<asio::posix::stream_descriptor>(
+                  asio_context_, shared_memory_->ReleaseOwnEventFd());
+          ReadValidation();
+        });
+  }
+
+  // [Client, Server] Copy as many queued messages into the outgoing ring as
+  // fit. A message may be split over several calls, the rest waits until the
+  // peer has made room.
+  void WriteToRing() {
+    SharedMemoryRing& tx = shared_memory_->GetTx();
+    while (true) {
+      size_t written_bytes = 0;
+      size_t written_messages = 0;
+      for (const SharedMessage<T>& msg : message_out_) {
+        size_t header_size = msg->header_size();
+        size_t msg_size = header_size + msg->data_size();
+        while (ring_out_offset_ < msg_size) {
+          size_t n;
+          if (ring_out_offset_ < header_size) {
+            n = tx.Write(
+                reinterpret_cast<const uint8_t*>(&msg->header) +
+                    ring_out_offset_,
+                header_size - ring_out_offset_);
+          } else {
+            n = tx.Write(msg->body.data() + (ring_out_offset_ - header_size),
+                         msg_size - ring_out_offset_);
+          }
+          if (n == 0) {
+            break;
+          }
+          ring_out_offset_ += n;
+          written_bytes += n;
+        }
+        if (ring_out_offset_ < msg_size) {
+          break;
+        }
+        ring_out_offset_ = 0;
+        written_messages++;
+      }
+      if (tx.IsCorrupt()) {
+        Close(DisconnectReason::kProtocolError);
+        return;
+      }
+      if (written_bytes > 0 &&
+          tx.GetHeader().reader_waiting.exchange(0) != 0) {
+        shared_memory_->Notify();
+      }
+      CompleteWrite(written_bytes, written_messages);
+      if (message_out_.empty()) {
+        return;
+      }
+
+      // the ring is full, sleep until the peer has read some of it
+      writing_ = true;
+      // a partly written message must stay at the front
+      write_count_ = ring_out_offset_ > 0 ? 1 : 0;
+      tx.GetHeader().writer_waiting.store(1);
+      if (tx.Full()) {
+        ring_writer_parked_ = true;
+        WaitForPeer();
+        return;
+      }
+      tx.GetHeader().writer_waiting.store(0);
+    }
+  }
+
+  // [Client, Server] Parse what is in the incoming ring, then come back
+  // through the io_context (so other connections get their turn) until it
+  // is empty, poll it for shared_memory_busy_poll and finally sleep.
+  void ReceiveFromRing() {
+    SharedMemoryRing& rx = shared_memory_->GetRx();
+    size_t n = rx.Read(read_buffer_.data() + read_end_,
+                       read_buffer_.size() - read_end_);
+    if (n > 0) {
+      MarkRead();
+      if (rx.GetHeader().writer_waiting.exchange(0) != 0) {
+        shared_memory_->Notify();
+      }
+      read_end_ += n;
+      ParseFrames();
+      poll_deadline_ = std::chrono::steady_clock::now() +
+                       options_.shared_memory_busy_poll;
+      asio::post(asio_context_, [this, self = this->shared_from_this()]() {
+        ReceiveFromRing();
+      });
+      return;
+    }
+    if (rx.IsCorrupt()) {
+      Close(DisconnectReason::kProtocolError);
+      return;
+    }
+    if (closed_) {
+      return;
+    }
+    if (options_.shared_memory_busy_poll.count() > 0 &&
+        std::chrono::steady_clock::now() < poll_deadline_) {
+      asio::post(asio_context_, [this, self = this->shared_from_this()]() {
+        ReceiveFromRing();
+      });
+      return;
+    }
+
+    // the writer checks reader_waiting after publishing, so either it sees
+    // the flag or this sees its bytes
+    rx.GetHeader().reader_waiting.store(1);
+    if (!rx.Empty()) {
+      rx.GetHeader().reader_waiting.store(0);
+      ReceiveFromRing();
+      return;
+    }
+    ring_reader_parked_ = true;
+    WaitForPeer();
+  }
+
+  // [Client, Server] Sleep on the eventfd until the peer wrote to the
+  // incoming ring or made room in the outgoing one.
+  void WaitForPeer() {
+    if (waiting_for_peer_) {
+      return;
+    }
+    waiting_for_peer_ = true;
+    shared_memory_event_->async_read_some(
+        asio::buffer(&event_count_, sizeof(event_count_)),
+        [this, self = this->shared_from_this()](system::error_code ec,
+                                                std::size_t /*length*/) {
+          waiting_for_peer_ = false;
+          if (ec) {
+            Close(DisconnectReason::kReadError);
+            return;
+          }
+          if (ring_reader_parked_) {
+            ring_reader_parked_ = false;
+            poll_deadline_ = std::chrono::steady_clock::now() +
+                             options_.shared_memory_busy_poll;
+            ReceiveFromRing();
+          }
+          if (ring_writer_parked_) {
+            ring_writer_parked_ = false;
+            WriteToRing();
+          }
+        });
+  }
+
+  // [Client, Server] Nothing but the end of the stream is expected on the
+  // socket once the rings carry the messages.
+  void WatchSocket() {
+    socket_.async_read_some(
+        asio::buffer(&socket_probe_, sizeof(socket_probe_)),
+        [this, self = this->shared_from_this()](system::error_code ec,
+                                                std::size_t /*length*/) {
+          if (!ec) {
+            WatchSocket();
+          } else if (ec == asio::error::eof) {
+            std::cout << "[" << id_ << "] socket has been terminated\n";
+            Close(DisconnectReason::kPeerClosed);
+          } else {
+            Close(DisconnectReason::kReadError);
+          }
+        });
+  }
+#endif
+
+  // [Client, Server] Start a write unless one is in flight or the queued
+  // messages stay corked, in which case the cork timer is armed.
+  void WriteOrCork() {
+    // nothing goes out before the handshake, which writes on its own
+    if (!validated_ || writing_ || message_out_.empty()) {
+      return;
+    }
+    if (!options_.IsCorked() ||
+        (options_.cork_bytes > 0 && queued_bytes_ >= options_.cork_bytes)) {
+      WriteMessages();
+      return;
+    }
+    if (options_.cork_delay.count() > 0 && !cork_timer_armed_) {
+      cork_timer_armed_ = true;
+      cork_timer_.expires_after(options_.cork_delay);
+      cork_timer_.async_wait([this, self = this->shared_from_this()](
+                                 system::error_code ec) {
+        // cancelled by WriteMessages, which also disarmed it
+        if (ec || !cork_timer_armed_) {
+          return;
+        }
+        cork_timer_armed_ = false;
+        if (!writing_ && !message_out_.empty()) {
+          WriteMessages();
+        }
+      });
+    }
+  }
+
+  // [Client, Server] Read whatever is available into the free tail of
+  // read_buffer_.
+  void ReadSome() {
+    socket_.async_read_some(
+        asio::buffer(read_buffer_.data() + read_end_,
+                     read_buffer_.size() - read_end_),
+        [this, self = this->shared_from_this()](system::error_code ec,
+                                                std::size_t length) {
+          if (!ec) {
+            MarkRead();
+            read_end_ += length;
+            ParseFrames();
+            ReadSome();
           } else if (ec == asio::error::eof) {
             std::cout << "[" << id_ << "] socket has been terminated\n";
-            socket_.close();
+            Close(DisconnectReason::kPeerClosed);
           } else {
-            // Write Message Header Fail
-            std::cout << "[" << id_ << "] Write Message Header Failed.\n";
-            socket_.close();
+            std::cerr << "[" << id_ << "] async_read_some error.\n";
+            Close(DisconnectReason::kReadError);
           }
         });
   }
 
+  // [Client, Server] Push every complete frame in read_buffer_ to the incoming
+  // queue in one go, then move the trailing partial frame to the front.
+  void ParseFrames() {
+    size_t pos = 0;
+    while (read_end_ - pos >= sizeof(MessageHeader<T>)) {
+      MessageHeader<T> header;
+      std::memcpy(&header, read_buffer_.data() + pos, sizeof(header));
+      size_t frame_size =
+          sizeof(header) + (header.data_size & MessageHeader<T>::kSizeMask);
+      if (read_end_ - pos < frame_size) {
+        break;
+      }
+      if (header.data_size == MessageHeader<T>::kHeartbeatFlag) {
+        metrics_.bytes_in.Add(frame_size);
+        pos += frame_size;
+        continue;
+      }
+
+      uint64_t trace_id = 0;
+      if constexpr (kTracingEnabled) {
+        trace_id = TraceMessage(TracePoint::kHeaderRead,
+                                metrics_.messages_in.Get());
+      }
+      metrics_.bytes_in.Add(frame_size);
+      metrics_.messages_in.Add();
+      const uint8_t* body = read_buffer_.data() + pos + sizeof(header);
+      Message<T> msg;
+      msg.header = header;
+      msg.body.resize(msg.data_size());
+      if (!msg.body.empty()) {
+        std::memcpy(msg.body.data(), body, msg.body.size());
+      }
+      msg.detach_correlation_id();
+      if constexpr (kTracingEnabled) {
+        msg.trace_id = trace_id;
+      }
+      pos += frame_size;
+      if (DispatchInline(msg)) {
+        continue;
+      }
+      if (owner_ == Owner::kServer) {
+        read_batch_.push_back({this->shared_from_this(), std::move(msg)});
+      } else if (owner_ == Owner::kClient) {
+        read_batch_.push_back({nullptr, std::move(msg)});
+      }
+      if constexpr (kTracingEnabled) {
+        read_batch_.back().trace_id = trace_id;
+      }
+    }
+
+    if (!read_batch_.empty()) {
+      if constexpr (kTracingEnabled) {
+        if (owner_ == Owner::kServer) {
+          for (const OwnedMessage<T>& owned : read_batch_) {
+            Trace(TracePoint::kEnqueued, owned.trace_id);
+          }
+        }
+      }
+      message_in_.push_batch(read_batch_);
+    }
+
+    size_t remaining = read_end_ - pos;
+    if (remaining > 0 && pos > 0) {
+      std::memmove(read_buffer_.data(), read_buffer_.data() + pos, remaining);
+    }
+    read_end_ = remaining;
+
+    // the partial frame does not fit, grow the buffer to hold all of it
+    if (remaining >= sizeof(MessageHeader<T>)) {
+      MessageHeader<T> header;
+      std::memcpy(&header, read_buffer_.data(), sizeof(header));
+      size_t frame_size =
+          sizeof(header) + (header.data_size & MessageHeader<T>::kSizeMask);
+      if (frame_size > read_buffer_.size()) {
+        read_buffer_.resize(frame_size);
+      }
+    }
+  }
+
   // [Client, Server]
   void AddToIncomingMessageQueue() {
+    // hand the body over instead of copying it, ReadHeader sizes a new one
+    AddToIncomingMessageQueue(temp_msg_);
+    temp_msg_.body.clear();
+    ReadHeader();
+  }
+
+  // [Client, Server] Count msg, then run its inline handler or move it into
+  // the incoming queue.
+  void AddToIncomingMessageQueue(Message<T>& msg) {
+    metrics_.bytes_in.Add(msg.header_size() + msg.data_size());
+    metrics_.messages_in.Add();
+    msg.detach_correlation_id();
+    if constexpr (kTracingEnabled) {
+      msg.trace_id = MakeTraceId(id_, metrics_.messages_in.Get() - 1);
+    }
+    if (DispatchInline(msg)) {
+      // handled in place, nothing to queue
+      return;
+    }
+    OwnedMessage<T> owned{nullptr, std::move(msg)};
     if (owner_ == Owner::kServer) {
-      message_in_.push_back({this->shared_from_this(), temp_msg_});
-    } else if (owner_ == Owner::kClient) {
-      message_in_.push_back({nullptr, temp_msg_});
+      owned.remote = this->shared_from_this();
+    }
+    if constexpr (kTracingEnabled) {
+      owned.trace_id = TraceMessage(TracePoint::kEnqueued,
+                                    metrics_.messages_in.Get() - 1);
+    }
+    message_in_.push_back(std::move(owned));
+  }
+
+  // [Client, Server] Run the inline handler, true if it consumed msg.
+  bool DispatchInline(Message<T>& msg) {
+    if (!on_message_ || !on_message_(this->shared_from_this(), msg)) {
+      return false;
+    }
+    if constexpr (kTracingEnabled) {
+      TraceMessage(TracePoint::kHandled, metrics_.messages_in.Get() - 1);
+    }
+    return true;
+  }
+
+  // [Server] Record point for the message with the given sequence number on
+  // this connection and return its trace ID. Client connections are not
+  // traced, so a client in the same process does not mix its events into the
+  // server's.
+  uint64_t TraceMessage(TracePoint point, uint64_t sequence) {
+    uint64_t trace_id = MakeTraceId(id_, sequence);
+    if (owner_ == Owner::kServer) {
+      Trace(point, trace_id);
+    }
+    return trace_id;
+  }
+
+  // [Client, Server] Failures are reported but leave the connection usable.
+  void ApplySocketOptions() {
+    system::error_code ec;
+    // Nagle only exists for TCP
+    int family = socket_.local_endpoint(ec).protocol().family();
+    if (!ec && options_.no_delay && IsIpFamily(family)) {
+      socket_.set_option(asio::ip::tcp::no_delay(true), ec);
+    }
+    if (!ec && options_.keep_alive) {
+      socket_.set_option(asio::socket_base::keep_alive(true), ec);
+    }
+    if (!ec && options_.send_buffer_size > 0) {
+      socket_.set_option(
+          asio::socket_base::send_buffer_size(options_.send_buffer_size), ec);
+    }
+    if (!ec && options_.receive_buffer_size > 0) {
+      socket_.set_option(asio::socket_base::receive_buffer_size(
+                             options_.receive_buffer_size),
+                         ec);
+    }
+    if (ec) {
+      std::cerr << "[" << id_ << "] set socket option error: " << ec.message()
+                << '\n';
+    }
+  }
+
+  static bool IsIpFamily(int family) {
+    return family == AF_INET || family == AF_INET6;
+  }
+
+  // [Client, Server] Activity stamps for the timeouts, in ticks of the wheel
+  // so that the hot path never reads the clock.
+  void MarkRead() {
+    if (timing_wheel_ != nullptr) {
+      last_read_tick_ = timing_wheel_->GetTick();
+    }
+  }
+
+  void MarkWritten() {
+    if (timing_wheel_ != nullptr) {
+      last_write_tick_ = timing_wheel_->GetTick();
+    }
+  }
+
+  // [Client, Server] Start the timers on the I/O thread, may be called from
+  // any thread.
+  void PostStartTimers() {
+    if (timing_wheel_ != nullptr) {
+      asio::post(asio_context_, [this, self = this->shared_from_this()]() {
+        StartTimers();
+      });
+    }
+  }
+
+  // [Client, Server] Restart the timeouts from now, on connecting and again
+  // once the handshake succeeded. The check still on the wheel goes stale.
+  void StartTimers() {
+    if (timing_wheel_ == nullptr) {
+      return;
+    }
+    uint64_t now = timing_wheel_->GetTick();
+    timer_start_tick_ = now;
+    last_read_tick_ = now;
+    last_write_tick_ = now;
+    timer_generation_++;
+    CheckTimeouts();
+  }
+
+  // [Client, Server] Close the connection if a timeout expired, otherwise
+  // send a heartbeat if one is due and come back at the nearest deadline.
+  // Only the connection's latest check is on the wheel, whatever timeouts
+  // are set.
+  void CheckTimeouts() {
+    if (closed_) {
+      return;
+    }
+    uint64_t now = timing_wheel_->GetTick();
+    uint64_t next = std::numeric_limits<uint64_t>::max();
+    // true if more than limit passed since the tick since, otherwise pull
+    // next in to the moment it would have
+    auto expired = [&](uint64_t since, std::chrono::milliseconds limit) {
+      if (limit.count() == 0) {
+        return false;
+      }
+      uint64_t ticks = timing_wheel_->ToTicks(limit);
+      if (now - since > ticks) {
+        return true;
+      }
+      next = std::min(next, since + ticks + 1 - now);
+      return false;
+    };
+
+    bool timeout = false;
+    if (!validated_) {
+      timeout = expired(timer_start_tick_, options_.handshake_timeout);
+    } else {
+      if (expired(std::max(last_read_tick_, last_write_tick_),
+                  options_.idle_timeout)) {
+        timeout = true;
+      }
+      if (expired(last_read_tick_, options_.read_timeout)) {
+        timeout = true;
+      }
+      if (writing_) {
+        if (expired(last_write_tick_, options_.write_timeout)) {
+          timeout = true;
+        }
+      } else if (options_.write_timeout.count() > 0) {
+        // a write that starts meanwhile has at least until then
+        next = std::min(next, timing_wheel_->ToTicks(options_.write_timeout));
+      }
+      if (!timeout && options_.heartbeat_interval.count() > 0) {
+        uint64_t interval = timing_wheel_->ToTicks(options_.heartbeat_interval);
+        if (now - last_write_tick_ < interval) {
+          next = std::min(next, last_write_tick_ + interval - now);
+        } else {
+          // anything queued goes out soon and does as well
+          if (!writing_ && message_out_.empty()) {
+            SendHeartbeat();
+          }
+          next = std::min(next, interval);
+        }
+      }
+    }
+    if (timeout) {
+      std::cout << "[" << id_ << "] timed out\n";
+      Close(DisconnectReason::kTimeout);
+      return;
+    }
+    if (next != std::numeric_limits<uint64_t>::max()) {
+      timing_wheel_->Schedule(
+          next, [weak = this->weak_from_this(),
+                 generation = timer_generation_]() {
+            auto self = weak.lock();
+            if (self && self->timer_generation_ == generation) {
+              self->CheckTimeouts();
+            }
+          });
+    }
+  }
+
+  // [Client, Server] Queue a bodyless frame the peer drops on arrival.
+  void SendHeartbeat() {
+    static const SharedMessage<T> heartbeat = []() {
+      Message<T> msg;
+      msg.header.data_size = MessageHeader<T>::kHeartbeatFlag;
+      return MakeSharedMessage(std::move(msg));
+    }();
+    queued_bytes_ += heartbeat->header_size();
+    queued_messages_++;
+    message_out_.push_back(heartbeat);
+    WriteMessages();
+  }
+
+  // [Client, Server] Every error path and Disconnect end up here.
+  void Close(DisconnectReason reason) {
+    // only ever runs on the I/O thread, so nothing can slip in between and
+    // anyone who sees closed_ also sees the reason
+    if (closed_) {
+      return;
+    }
+    disconnect_reason_ = reason;
+    closed_ = true;
+    system::error_code ec;
+    socket_.close(ec);
+    cork_timer_armed_ = false;
+    cork_timer_.cancel();
+#if defined(NET_HAS_SHARED_MEMORY)
+    if (shared_memory_event_) {
+      shared_memory_event_->close(ec);
+    }
+#endif
+    if (on_close_) {
+      on_close_(this->shared_from_this());
     }
-    ReadHeader();
   }
 
   // [Client, Server]
-  uint64_t Scramble(uint64_t input) {
-    uint64_t out = input ^ 0xdeadbeefdeadbeef;
-    out = (out & 0xf0f0f0f0f0f0f0) >> 4 | (out & 0xf0f0f0f0f0f0f0) << 4;
-    return out ^ 0xbeef12345678dead;
+  bool OverHighWatermark(size_t bytes, size_t messages) const {
+    return (options_.high_watermark_bytes > 0 &&
+            bytes > options_.high_watermark_bytes) ||
+           (options_.high_watermark_messages > 0 &&
+            messages > options_.high_watermark_messages);
+  }
+
+  // [Client, Server]
+  bool BelowLowWatermark() const {
+    return queued_bytes_ <= options_.low_watermark_bytes &&
+           queued_messages_ <= options_.low_watermark_messages;
+  }
+
+  // [Client, Server]
+  void SubtractQueued(const Message<T>& msg) {
+    queued_bytes_ -= msg.header_size() + msg.data_size();
+    queued_messages_--;
   }
 
   // [Client, Server]
   void WriteValidation() {
-    asio::async_write(socket_, asio::buffer(&handshake_out_, sizeof(uint64_t)),
-                      [this](system::error_code ec, std::size_t length) {
-                        if (!ec) {
-                          if (owner_ == Owner::kServer) {
-                            ReadValidation();
-                          } else if (owner_ == Owner::kClient) {
-                            ReadHeader();
-                          }
-                        } else if (ec == asio::error::eof) {
-                          std::cout << "[" << id_
-                                    << "] socket has been terminated\n";
-                          socket_.close();
-                        } else {
-                          std::cerr << "[------] write validation error.\n";
-                          socket_.close();
-                        }
-                      });
+    asio::async_write(
+        socket_, asio::buffer(&handshake_out_, sizeof(uint64_t)),
+        [this, self = this->shared_from_this()](system::error_code ec,
+                                                std::size_t /*length*/) {
+          if (!ec) {
+            if (owner_ == Owner::kServer) {
+              ReadValidation();
+            } else if (owner_ == Owner::kClient) {
+              validated_ = true;
+              StartTimers();
+              if (on_validated_) {
+                on_validated_(this->shared_from_this());
+              }
+              StartReading();
+              WriteOrCork();
+            }
+          } else if (ec == asio::error::eof) {
+            std::cout << "[" << id_ << "] socket has been terminated\n";
+            Close(DisconnectReason::kHandshakeFailed);
+          } else {
+            std::cerr << "[------] write validation error.\n";
+            Close(DisconnectReason::kHandshakeFailed);
+          }
+        });
   }
 
   // [Client, Server]
   void ReadValidation() {
     asio::async_read(
         socket_, asio::buffer(&handshake_in_, sizeof(uint64_t)),
-        [this /*, server*/](system::error_code ec, std::size_t length) {
+        [this, self = this->shared_from_this()](system::error_code ec,
+                                                std::size_t /*length*/) {
           if (!ec) {
             if (owner_ == Owner::kServer) {
               if (handshake_in_ == handshake_check_) {
                 std::cout << "[Server] Client Validation Success.\n";
-                ReadHeader();
+                validated_ = true;
+                StartTimers();
+                if (on_validated_) {
+                  on_validated_(this->shared_from_this());
+                }
+                StartReading();
+                WriteOrCork();
               } else {
+                // also what a client of another protocol version answers
                 std::cerr << "[Server] Client Validation Failure.\n";
-                socket_.close();
+                Close(DisconnectReason::kHandshakeFailed);
               }
             } else if (owner_ == Owner::kClient) {
               handshake_out_ = Scramble(handshake_in_);
@@ -239,31 +1303,91 @@ class Connection : public std::enable_shared_from_this<Connection<T>> {
             }
           } else if (ec == asio::error::eof) {
             std::cout << "[" << id_ << "] socket has been terminated\n";
-            socket_.close();
+            Close(DisconnectReason::kHandshakeFailed);
           } else {
             std::cerr << "[------] read validation error.\n";
-            socket_.close();
+            Close(DisconnectReason::kHandshakeFailed);
           }
         });
   }
 
  protected:
   // each connection has a unique socket to remote
-  asio::ip::tcp::socket socket_;
+  Socket socket_;
   // this context is shared with the whole asio instance
   asio::io_context& asio_context_;
   // owner decide how some of the connection behaves
   Owner owner_;
-  uint32_t id_;
+  uint32_t id_ = 0;
 
   Message<T> temp_msg_;
 
-  TsQueue<Message<T>> message_out_;
-  TsQueue<OwnedMessage<T>>& message_in_;
+  // only touched from the asio context, so it needs no locking
+  std::deque<SharedMessage<T>> message_out_;
+  IncomingMessageQueue<T>& message_in_;
+
+  ConnectionOptions options_;
+  // buffers and message count of the write currently in flight
+  std::vector<asio::const_buffer> write_buffers_;
+  size_t write_count_ = 0;
+  bool writing_ = false;
+
+  // corking, the timer is only touched from the asio context
+  asio::steady_timer cork_timer_;
+  bool cork_timer_armed_ = false;
+  std::atomic<bool> flush_pending_{false};
+
+#if defined(NET_HAS_SHARED_MEMORY)
+  // shared memory transport, only touched from the asio context
+  bool use_shared_memory_ = false;
+  std::unique_ptr<SharedMemoryChannel> shared_memory_;
+  // the eventfd this side sleeps on
+  std::unique_ptr<asio::posix::stream_descriptor> shared_memory_event_;
+  uint64_t event_count_ = 0;
+  bool waiting_for_peer_ = false;
+  bool ring_reader_parked_ = false;
+  bool ring_writer_parked_ = false;
+  // bytes of the front message already in the outgoing ring
+  size_t ring_out_offset_ = 0;
+  std::chrono::steady_clock::time_point poll_deadline_;
+  uint8_t socket_probe_ = 0;
+#endif
+
+  // timeouts and heartbeats, only touched from the asio context; the wheel
+  // is shared with the other connections of the context
+  TimingWheel* timing_wheel_ = nullptr;
+  bool validated_ = false;
+  uint64_t timer_start_tick_ = 0;
+  uint64_t last_read_tick_ = 0;
+  uint64_t last_write_tick_ = 0;
+  uint64_t timer_generation_ = 0;
+
+  // optional UDP side channel, shared with the other connections of a server
+  DatagramChannel<T>* datagram_ = nullptr;
+  DatagramPeer datagram_peer_;
+
+  // updated by the sending threads and the I/O thread, read by anyone
+  std::atomic<size_t> queued_bytes_{0};
+  std::atomic<size_t> queued_messages_{0};
+  std::atomic<bool> backpressured_{false};
+  std::function<void(std::shared_ptr<Connection<T>>)> on_writable_;
+
+  std::atomic<bool> established_{false};
+  std::atomic<bool> closed_{false};
+  std::atomic<DisconnectReason> disconnect_reason_{DisconnectReason::kNone};
+  std::function<void(std::shared_ptr<Connection<T>>)> on_close_;
+  std::function<void(std::shared_ptr<Connection<T>>)> on_validated_;
+  ConnectionMetrics metrics_;
+  std::function<bool(std::shared_ptr<Connection<T>>, Message<T>&)> on_message_;
+
+  // kBuffered receive buffer, bytes [0, read_end_) are not parsed yet
+  std::vector<uint8_t> read_buffer_;
+  size_t read_end_ = 0;
+  std::vector<OwnedMessage<T>> read_batch_;
 
   // validation
-  uint64_t handshake_in_;
-  uint64_t handshake_out_;
-  uint64_t handshake_check_;
+  uint64_t handshake_in_ = 0;
+  uint64_t handshake_out_ = 0;
+  uint64_t handshake_check_ = 0;
 };
 }  // namespace net
\ No newline at end of file
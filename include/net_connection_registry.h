@@ -0,0 +1,137 @@
+#pragma once
+#include <shared_mutex>
+#include "net_common.h"
+
+namespace net {
+template <typename T>
+class Connection;
+
+// Slot map of live connections. An ID is a generational handle: the low
+// kIndexBits bits index a slot, the rest count how often that slot has been
+// reused, so a stale ID never finds the connection that took its slot over.
+// The generation has 32 - kIndexBits bits; a slot that has used them all is
+// retired rather than wrapped, so a stale ID can never match again. That
+// bounds a registry to about 2^32 IDs over its lifetime, after which Insert
+// returns kInvalidId.
+// Insert, Find and Remove are O(1), ForEach only walks live connections.
+// Safe to use from any thread, ForEach holds a shared lock while it runs.
+template <typename T>
+class ConnectionRegistry {
+ public:
+  static constexpr uint32_t kIndexBits = 20;
+  static constexpr uint32_t kMaxConnections = 1u << kIndexBits;
+  static constexpr uint32_t kMaxGenerations = 1u << (32 - kIndexBits);
+  static constexpr uint32_t kInvalidId = std::numeric_limits<uint32_t>::max();
+
+  ConnectionRegistry() = default;
+  ConnectionRegistry(const ConnectionRegistry<T>&) = delete;
+  ConnectionRegistry& operator=(const ConnectionRegistry<T>&) = delete;
+
+  // Return the ID of the new entry, or kInvalidId if every slot is taken.
+  uint32_t Insert(std::shared_ptr<Connection<T>> connection) {
+    std::unique_lock<std::shared_mutex> lock(mux_);
+    uint32_t index = 0;
+    if (!free_slots_.empty()) {
+      index = free_slots_.back();
+      free_slots_.pop_back();
+    } else if (slots_.size() < kMaxConnections) {
+      index = static_cast<uint32_t>(slots_.size());
+      slots_.emplace_back();
+    } else {
+      return kInvalidId;
+    }
+
+    Slot& slot = slots_[index];
+    uint32_t id = MakeId(index, slot.generation);
+    slot.dense_index = static_cast<uint32_t>(connections_.size());
+    slot.used = true;
+    connections_.push_back(std::move(connection));
+    ids_.push_back(id);
+    return id;
+  }
+
+  // nullptr if the ID is stale or was never handed out
+  std::shared_ptr<Connection<T>> Find(uint32_t id) const {
+    std::shared_lock<std::shared_mutex> lock(mux_);
+    const Slot* slot = GetSlot(id);
+    return slot ? connections_[slot->dense_index] : nullptr;
+  }
+
+  // Return the removed connection, nullptr if the ID is stale.
+  std::shared_ptr<Connection<T>> Remove(uint32_t id) {
+    std::unique_lock<std::shared_mutex> lock(mux_);
+    Slot* slot = const_cast<Slot*>(GetSlot(id));
+    if (!slot) {
+      return nullptr;
+    }
+
+    // move the last live connection into the hole
+    uint32_t dense_index = slot->dense_index;
+    std::shared_ptr<Connection<T>> connection =
+        std::move(connections_[dense_index]);
+    if (dense_index != connections_.size() - 1) {
+      connections_[dense_index] = std::move(connections_.back());
+      ids_[dense_index] = ids_.back();
+      slots_[GetIndex(ids_[dense_index])].dense_index = dense_index;
+    }
+    connections_.pop_back();
+    ids_.pop_back();
+
+    // retire the slot instead of wrapping its generation, and never hand out
+    // kInvalidId
+    slot->used = false;
+    slot->generation++;
+    uint32_t index = GetIndex(id);
+    if (slot->generation < kMaxGenerations &&
+        MakeId(index, slot->generation) != kInvalidId) {
+      free_slots_.push_back(index);
+    }
+    return connection;
+  }
+
+  // Call fn for every live connection. fn must not insert or remove.
+  template <typename Fn>
+  void ForEach(Fn&& fn) const {
+    std::shared_lock<std::shared_mutex> lock(mux_);
+    for (const auto& connection : connections_) {
+      fn(connection);
+    }
+  }
+
+  size_t size() const {
+    std::shared_lock<std::shared_mutex> lock(mux_);
+    return connections_.size();
+  }
+
+ private:
+  struct Slot {
+    uint32_t generation = 0;
+    uint32_t dense_index = 0;
+    bool used = false;
+  };
+
+  static uint32_t MakeId(uint32_t index, uint32_t generation) {
+    return (generation << kIndexBits) | index;
+  }
+  static uint32_t GetIndex(uint32_t id) { return id & (kMaxConnections - 1); }
+
+  const Slot* GetSlot(uint32_t id) const {
+    uint32_t index = GetIndex(id);
+    if (index >= slots_.size()) {
+      return nullptr;
+    }
+    const Slot& slot = slots_[index];
+    if (!slot.used || MakeId(index, slot.generation) != id) {
+      return nullptr;
+    }
+    return &slot;
+  }
+
+  mutable std::shared_mutex mux_;
+  std::vector<Slot> slots_;
+  std::vector<uint32_t> free_slots_;
+  // live connections packed together, ids_ holds the ID of each one
+  std::vector<std::shared_ptr<Connection<T>>> connections_;
+  std::vector<uint32_t> ids_;
+};
+}  // namespace net
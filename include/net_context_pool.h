@@ -0,0 +1,60 @@
+#pragma once
+#include "net_common.h"
+
+namespace net {
+// A pool of io_contexts, each one run by a thread of its own. A connection is
+// bound to a single context for its whole life, so all of its handlers run on
+// the same thread and never race with each other, no strand is needed.
+class ContextPool {
+ public:
+  ContextPool(size_t pool_size) {
+    pool_size = std::max<size_t>(pool_size, 1);
+    for (size_t i = 0; i < pool_size; i++) {
+      // each context is only ever run by one thread
+      contexts_.push_back(std::make_unique<asio::io_context>(1));
+      // keep run() from returning while there is no work queued yet
+      work_guards_.push_back(asio::make_work_guard(*contexts_.back()));
+    }
+  }
+  ContextPool(const ContextPool&) = delete;
+  ContextPool& operator=(const ContextPool&) = delete;
+  ~ContextPool() { Stop(); }
+
+  void Start() {
+    for (auto& context : contexts_) {
+      threads_.emplace_back([&context]() { context->run(); });
+    }
+  }
+
+  void Stop() {
+    work_guards_.clear();
+    for (auto& context : contexts_) {
+      context->stop();
+    }
+    for (auto& thread : threads_) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+    threads_.clear();
+  }
+
+  asio::io_context& GetContext(size_t index) { return *contexts_[index]; }
+
+  // Hand out the contexts round-robin. Safe to call from any thread, the
+  // accept handlers and ListenLocal may do so at the same time.
+  asio::io_context& GetNextContext() {
+    return *contexts_[next_context_.fetch_add(1, std::memory_order_relaxed) %
+                      contexts_.size()];
+  }
+
+  size_t size() const { return contexts_.size(); }
+
+ private:
+  std::vector<std::unique_ptr<asio::io_context>> contexts_;
+  std::vector<asio::executor_work_guard<asio::io_context::executor_type>>
+      work_guards_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> next_context_{0};
+};
+}  // namespace net
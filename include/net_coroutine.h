@@ -0,0 +1,201 @@
+#pragma once
+#include "net_common.h"
+#include "net_connection.h"
+#include "net_context_pool.h"
+#include "net_message.h"
+
+// Coroutine flavour of the framework built on asio::awaitable. Only available
+// when compiled as C++20 (NET_ENABLE_COROUTINES in CMake), the callback based
+// Connection, ServerInterface and ClientInterface are unaffected.
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+namespace net {
+// A connection driven by coroutines instead of a chain of callbacks. Receive,
+// Send and Handshake suspend the calling coroutine until the operation is
+// done and throw system::system_error on failure. asio recycles coroutine
+// frames per thread and Receive reuses the body of the message it fills, so a
+// steady receive/send loop does not allocate. At most one coroutine may
+// Receive and one may Send at a time, both on the connection's executor.
+template <typename T>
+class CoConnection : public std::enable_shared_from_this<CoConnection<T>> {
+ public:
+  using Owner = typename Connection<T>::Owner;
+
+  CoConnection(Owner owner, asio::ip::tcp::socket&& socket, uint32_t id = 0)
+      : socket_(std::move(socket)), owner_(owner), id_(id) {}
+
+  // [Client, Server] The same handshake as Connection, so either side may
+  // talk to the callback based other side. False if the client answered
+  // wrongly.
+  asio::awaitable<bool> Handshake() {
+    uint64_t value = 0;
+    if (owner_ == Owner::kServer) {
+      std::random_device rd;
+      std::mt19937_64 gen(rd());
+      uint64_t out = gen();
+      co_await asio::async_write(socket_, asio::buffer(&out, sizeof(out)),
+                                 asio::use_awaitable);
+      co_await asio::async_read(socket_, asio::buffer(&value, sizeof(value)),
+                                asio::use_awaitable);
+      co_return value == Connection<T>::Scramble(out);
+    }
+
+    co_await asio::async_read(socket_, asio::buffer(&value, sizeof(value)),
+                              asio::use_awaitable);
+    value = Connection<T>::Scramble(value);
+    co_await asio::async_write(socket_, asio::buffer(&value, sizeof(value)),
+                               asio::use_awaitable);
+    co_return true;
+  }
+
+  // [Client, Server] Read the next message into msg, reusing its body.
+  // Heartbeats of the peer are skipped.
+  asio::awaitable<void> Receive(Message<T>& msg) {
+    do {
+      co_await asio::async_read(
+          socket_, asio::buffer(&msg.header, sizeof(MessageHeader<T>)),
+          asio::use_awaitable);
+    } while (msg.header.data_size == MessageHeader<T>::kHeartbeatFlag);
+    msg.body.resize(msg.data_size());
+    if (msg.data_size() > 0) {
+      co_await asio::async_read(
+          socket_, asio::buffer(msg.data_addr(), msg.data_size()),
+          asio::use_awaitable);
+    }
+    msg.detach_correlation_id();
+  }
+
+  // [Client, Server]
+  asio::awaitable<Message<T>> Receive() {
+    Message<T> msg;
+    co_await Receive(msg);
+    co_return msg;
+  }
+
+  // [Client, Server] Header and body go out in a single gathered write.
+  asio::awaitable<void> Send(const Message<T>& msg) {
+    std::array<asio::const_buffer, 2> buffers = {
+        asio::buffer(&msg.header, sizeof(MessageHeader<T>)),
+        asio::buffer(msg.body.data(), msg.body.size())};
+    co_await asio::async_write(socket_, buffers, asio::use_awaitable);
+  }
+
+  // [Client, Server] Pending Receive and Send calls fail with
+  // operation_aborted.
+  void Close() {
+    system::error_code ec;
+    socket_.close(ec);
+  }
+
+  bool IsConnected() const { return socket_.is_open(); }
+
+  uint32_t GetID() const { return id_; }
+
+  asio::ip::tcp::socket& GetSocket() { return socket_; }
+
+ private:
+  asio::ip::tcp::socket socket_;
+  Owner owner_;
+  uint32_t id_ = 0;
+};
+
+// [Client] Resolve host, connect and complete the handshake on the executor
+// of the calling coroutine.
+template <typename T>
+asio::awaitable<std::shared_ptr<CoConnection<T>>> CoConnect(
+    const std::string& host, uint16_t port) {
+  auto executor = co_await asio::this_coro::executor;
+  asio::ip::tcp::resolver resolver(executor);
+  auto endpoints = co_await resolver.async_resolve(
+      host, std::to_string(port), asio::use_awaitable);
+  asio::ip::tcp::socket socket(executor);
+  co_await asio::async_connect(socket, endpoints, asio::use_awaitable);
+
+  auto connection = std::make_shared<CoConnection<T>>(
+      CoConnection<T>::Owner::kClient, std::move(socket));
+  co_await connection->Handshake();
+  co_return connection;
+}
+
+// Accepts clients and runs a session coroutine for each of them on the I/O
+// thread its connection is bound to. Connections are spread round-robin over
+// io_threads contexts like in ServerInterface.
+template <typename T>
+class CoServer {
+ public:
+  // Runs once per client after a successful handshake, the connection is
+  // closed when it returns or throws.
+  using SessionHandler =
+      std::function<asio::awaitable<void>(std::shared_ptr<CoConnection<T>>)>;
+
+  CoServer(uint16_t port, SessionHandler handler, size_t io_threads = 1)
+      : context_pool_(io_threads),
+        acceptor_(context_pool_.GetContext(0),
+                  asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)),
+        handler_(std::move(handler)) {}
+
+  virtual ~CoServer() { Stop(); }
+
+  void Start() {
+    asio::co_spawn(acceptor_.get_executor(), Listen(), asio::detached);
+    context_pool_.Start();
+    std::cout << "[Server] Started." << std::endl;
+  }
+
+  void Stop() {
+    context_pool_.Stop();
+    std::cout << "[Server] Stopped.\n";
+  }
+
+ private:
+  asio::awaitable<void> Listen() {
+    while (true) {
+      // the socket is bound to the context that will run its session
+      asio::io_context& context = context_pool_.GetNextContext();
+      asio::ip::tcp::socket socket(context);
+      system::error_code ec;
+      co_await acceptor_.async_accept(
+          socket, asio::redirect_error(asio::use_awaitable, ec));
+      if (ec == asio::error::operation_aborted) {
+        co_return;
+      } else if (ec) {
+        std::cout << "[Server] New Connection Error:" << ec.message() << '\n';
+        continue;
+      }
+
+      std::cout << "[Server] New Connection: " << socket.remote_endpoint()
+                << '\n';
+      auto connection = std::make_shared<CoConnection<T>>(
+          CoConnection<T>::Owner::kServer, std::move(socket), next_id_++);
+      asio::co_spawn(context, Serve(std::move(connection)), asio::detached);
+    }
+  }
+
+  asio::awaitable<void> Serve(std::shared_ptr<CoConnection<T>> connection) {
+    try {
+      if (co_await connection->Handshake()) {
+        co_await handler_(connection);
+      } else {
+        std::cerr << "[Server] Client Validation Failure.\n";
+      }
+    } catch (std::exception& e) {
+      // the client went away or the session gave up
+      std::cout << "[" << connection->GetID() << "] " << e.what() << '\n';
+    }
+    connection->Close();
+  }
+
+  // The contexts must be placed before the acceptor due to class
+  // initialization order.
+  ContextPool context_pool_;
+  asio::ip::tcp::acceptor acceptor_;
+  SessionHandler handler_;
+  // only touched by Listen
+  uint32_t next_id_ = 0;
+};
+}  // namespace net
+#endif
@@ -0,0 +1,325 @@
+#pragma once
+#include "net_common.h"
+#include "net_dispatch.h"
+#include "net_message.h"
+
+namespace net {
+template <typename T>
+class Connection;
+
+// Prefix of every datagram. A data datagram carries a MessageHeader<T> and
+// the body after it, a datagram with sequence 0 is a hello (client to
+// server) or its acknowledgement (server to client) and carries nothing.
+struct DatagramHeader {
+  // the handshake value the server sent over the TCP connection, only the
+  // two ends of that connection know it
+  uint64_t token = 0;
+  // the ID the server assigned in ConnectToClient, kUnknownConnectionId in
+  // a hello since the client does not know it yet
+  uint32_t connection_id = 0;
+  // numbered per connection and direction, starting at 1
+  uint32_t sequence = 0;
+};
+
+constexpr uint32_t kUnknownConnectionId =
+    std::numeric_limits<uint32_t>::max();
+// Whole datagrams, headers included, stay below the IPv6 minimum MTU so they
+// are never fragmented. Larger messages go over TCP.
+constexpr size_t kDefaultMaxDatagramSize = 1200;
+
+// Datagram state of one connection.
+struct DatagramPeer {
+  // written once before ready is set: where the peer receives datagrams,
+  // and the token and ID every datagram carries
+  asio::ip::udp::endpoint endpoint;
+  uint64_t token = 0;
+  uint32_t connection_id = kUnknownConnectionId;
+  std::atomic<bool> ready{false};
+  std::atomic<uint32_t> next_sequence{0};
+  // newest sequence number received per op, only the receiving thread
+  // touches it
+  std::vector<uint32_t> newest;
+
+  // True if sequence is newer than every datagram of op received so far.
+  bool Accept(size_t op, uint32_t sequence) {
+    if (op >= newest.size()) {
+      newest.resize(op + 1, 0);
+    }
+    // serial number arithmetic, so the sequence may wrap around
+    if (newest[op] != 0 &&
+        static_cast<int32_t>(sequence - newest[op]) <= 0) {
+      return false;
+    }
+    newest[op] = sequence;
+    return true;
+  }
+};
+
+struct DatagramStats {
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  // older than a datagram of the same op that arrived first
+  uint64_t stale = 0;
+  // malformed, or not matching any connection
+  uint64_t rejected = 0;
+  // the socket buffer was full
+  uint64_t send_dropped = 0;
+};
+
+// UDP socket shared by every connection of a server, or owned by a client,
+// carrying the ops marked unreliable. Such a message skips the TCP stream,
+// so a retransmit of bulk data can no longer hold it up, but it may be lost
+// or reordered: a datagram older than one already received for the same op
+// is dropped. Until the client has registered with a hello, and for
+// messages too large for one datagram, the ops still go over TCP.
+template <typename T>
+class DatagramChannel {
+ public:
+  // Find the connection a datagram claims to belong to, nullptr if the
+  // token does not match.
+  using Resolver = std::function<std::shared_ptr<Connection<T>>(
+      const DatagramHeader& header)>;
+
+  DatagramChannel(asio::io_context& asio_context, Resolver resolver,
+                  size_t max_datagram_size = kDefaultMaxDatagramSize)
+      : socket_(asio_context),
+        hello_timer_(asio_context),
+        resolver_(std::move(resolver)),
+        max_datagram_size_(max_datagram_size),
+        receive_buffer_(64 * 1024) {}
+
+  DatagramChannel(const DatagramChannel<T>&) = delete;
+  DatagramChannel& operator=(const DatagramChannel<T>&) = delete;
+
+  // Send op as datagrams from now on, false if op is beyond
+  // MessageOpCount<T>. Mark the ops before any connection uses the channel,
+  // they are read without locking.
+  bool SetUnreliable(T op) {
+    size_t index = static_cast<size_t>(op);
+    if (index >= kOpCount) {
+      return false;
+    }
+    unreliable_[index] = true;
+    return true;
+  }
+
+  bool IsUnreliable(T op) const {
+    size_t index = static_cast<size_t>(op);
+    return index < kOpCount && unreliable_[index];
+  }
+
+  // [Server] Receive on local, typically the address the TCP acceptor is
+  // bound to. An IPv6 wildcard also takes IPv4, like a dual-stack acceptor.
+  void Listen(const asio::ip::udp::endpoint& local) {
+    Open(local);
+    Receive();
+  }
+
+  // [Client] Register with the server at server_endpoint for the connection
+  // token belongs to, resending the hello until it is acknowledged. Runs on
+  // the context of the channel.
+  void Connect(const asio::ip::udp::endpoint& server_endpoint,
+               uint64_t token) {
+    Open(asio::ip::udp::endpoint(server_endpoint.protocol(), 0));
+    server_endpoint_ = server_endpoint;
+    hello_token_ = token;
+    hello_attempts_ = 0;
+    Receive();
+    SendHello();
+  }
+
+  void Close() {
+    system::error_code ec;
+    hello_timer_.cancel();
+    socket_.close(ec);
+  }
+
+  // [Client, Server] Send msg to peer as one datagram. False if it has to go
+  // over TCP instead: the peer has not registered yet, msg is a request or
+  // reply, or it does not fit. A datagram the socket has no room for is
+  // dropped and still counts as sent. Safe to call from any thread.
+  bool Send(DatagramPeer& peer, const Message<T>& msg) {
+    if (!peer.ready.load(std::memory_order_acquire) ||
+        (msg.header.data_size & MessageHeader<T>::kCorrelationFlag) != 0 ||
+        sizeof(DatagramHeader) + msg.header_size() + msg.data_size() >
+            max_datagram_size_) {
+      return false;
+    }
+    DatagramHeader header;
+    header.token = peer.token;
+    header.connection_id = peer.connection_id;
+    header.sequence = peer.next_sequence.fetch_add(1) + 1;
+    if (header.sequence == 0) {
+      // 0 marks a hello
+      header.sequence = peer.next_sequence.fetch_add(1) + 1;
+    }
+    std::array<asio::const_buffer, 3> buffers = {
+        asio::buffer(&header, sizeof(header)),
+        asio::buffer(&msg.header, msg.header_size()),
+        asio::buffer(msg.body.data(), msg.data_size())};
+    SendTo(buffers, peer.endpoint);
+    return true;
+  }
+
+  DatagramStats GetStats() const {
+    DatagramStats stats;
+    stats.sent = sent_;
+    stats.received = received_;
+    stats.stale = stale_;
+    stats.rejected = rejected_;
+    stats.send_dropped = send_dropped_;
+    return stats;
+  }
+
+ private:
+  static constexpr size_t kOpCount = MessageOpCount<T>::value;
+  static constexpr int kHelloAttempts = 50;
+  static constexpr std::chrono::milliseconds kHelloInterval{100};
+
+  void Open(const asio::ip::udp::endpoint& local) {
+    socket_.open(local.protocol());
+    if (local.address().is_v6()) {
+      socket_.set_option(asio::ip::v6_only(false));
+    }
+    socket_.bind(local);
+    // a full socket buffer drops the datagram instead of blocking the sender
+    socket_.non_blocking(true);
+  }
+
+  template <typename Buffers>
+  void SendTo(const Buffers& buffers,
+              const asio::ip::udp::endpoint& endpoint) {
+    system::error_code ec;
+    {
+      // sockets are not safe to share, senders may be on any thread
+      std::unique_lock<std::mutex> lock(send_mux_);
+      socket_.send_to(buffers, endpoint, 0, ec);
+    }
+    if (ec) {
+      send_dropped_++;
+    }
+    sent_++;
+  }
+
+  void SendHello() {
+    DatagramHeader header;
+    header.token = hello_token_;
+    header.connection_id = kUnknownConnectionId;
+    SendTo(asio::buffer(&header, sizeof(header)), server_endpoint_);
+    if (++hello_attempts_ >= kHelloAttempts) {
+      std::cerr << "[Client] No answer to the datagram hello.\n";
+      return;
+    }
+    hello_timer_.expires_after(kHelloInterval);
+    hello_timer_.async_wait([this](system::error_code ec) {
+      if (!ec) {
+        SendHello();
+      }
+    });
+  }
+
+  void Receive() {
+    socket_.async_receive_from(
+        asio::buffer(receive_buffer_), sender_,
+        [this](system::error_code ec, std::size_t length) {
+          if (ec == asio::error::operation_aborted || !socket_.is_open()) {
+            return;
+          }
+          if (!ec) {
+            Dispatch(length);
+          }
+          Receive();
+        });
+  }
+
+  void Dispatch(size_t length) {
+    DatagramHeader header;
+    if (length < sizeof(header)) {
+      rejected_++;
+      return;
+    }
+    std::memcpy(&header, receive_buffer_.data(), sizeof(header));
+    std::shared_ptr<Connection<T>> connection = resolver_(header);
+    if (!connection || !connection->IsConnected()) {
+      rejected_++;
+      return;
+    }
+    DatagramPeer& peer = connection->GetDatagramPeer();
+    bool server = connection->GetOwner() == Connection<T>::Owner::kServer;
+
+    if (header.sequence == 0) {
+      if (server) {
+        // a hello, the client sends its datagrams from where it receives
+        // them; a repeated one only means the acknowledgement got lost
+        if (!peer.ready.load(std::memory_order_relaxed)) {
+          peer.endpoint = sender_;
+          peer.token = header.token;
+          peer.connection_id = connection->GetID();
+          peer.ready.store(true, std::memory_order_release);
+        }
+        DatagramHeader ack;
+        ack.token = header.token;
+        ack.connection_id = connection->GetID();
+        SendTo(asio::buffer(&ack, sizeof(ack)), sender_);
+      } else if (!peer.ready.load(std::memory_order_relaxed)) {
+        hello_timer_.cancel();
+        peer.endpoint = sender_;
+        peer.token = header.token;
+        peer.connection_id = header.connection_id;
+        peer.ready.store(true, std::memory_order_release);
+      }
+      return;
+    }
+
+    MessageHeader<T> msg_header;
+    if (length < sizeof(header) + sizeof(msg_header) ||
+        !peer.ready.load(std::memory_order_relaxed)) {
+      rejected_++;
+      return;
+    }
+    std::memcpy(&msg_header, receive_buffer_.data() + sizeof(header),
+                sizeof(msg_header));
+    size_t body_size = length - sizeof(header) - sizeof(msg_header);
+    size_t op = static_cast<size_t>(msg_header.op);
+    if (msg_header.data_size != body_size || op >= kOpCount) {
+      rejected_++;
+      return;
+    }
+    received_++;
+    if (!peer.Accept(op, header.sequence)) {
+      stale_++;
+      return;
+    }
+
+    Message<T> msg;
+    msg.header = msg_header;
+    msg.body.resize(body_size);
+    if (body_size > 0) {
+      std::memcpy(msg.body.data(),
+                  receive_buffer_.data() + sizeof(header) + sizeof(msg_header),
+                  body_size);
+    }
+    connection->ReceiveDatagram(std::move(msg));
+  }
+
+  asio::ip::udp::socket socket_;
+  std::mutex send_mux_;
+  asio::steady_timer hello_timer_;
+  Resolver resolver_;
+  size_t max_datagram_size_;
+  std::array<bool, kOpCount> unreliable_{};
+
+  // only touched by the receiving thread
+  std::vector<uint8_t> receive_buffer_;
+  asio::ip::udp::endpoint sender_;
+  asio::ip::udp::endpoint server_endpoint_;
+  uint64_t hello_token_ = 0;
+  int hello_attempts_ = 0;
+
+  std::atomic<uint64_t> sent_{0};
+  std::atomic<uint64_t> received_{0};
+  std::atomic<uint64_t> stale_{0};
+  std::atomic<uint64_t> rejected_{0};
+  std::atomic<uint64_t> send_dropped_{0};
+};
+}  // namespace net
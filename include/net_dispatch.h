@@ -0,0 +1,61 @@
+#pragma once
+#include "net_common.h"
+#include "net_message.h"
+
+namespace net {
+template <typename T>
+class Connection;
+
+// Number of op values a DispatchTable has room for, ops must lie in
+// [0, value). Specialize it when the ops of T go beyond 255, or to shrink the
+// table:
+//   template <>
+//   struct net::MessageOpCount<MyOp> : std::integral_constant<size_t, 16> {};
+template <typename T>
+struct MessageOpCount : std::integral_constant<size_t, 256> {};
+
+// Dense table of handlers indexed by op. Fill it before the server starts,
+// it is read by every I/O thread without any locking afterwards.
+template <typename T>
+class DispatchTable {
+ public:
+  using Handler =
+      std::function<void(std::shared_ptr<Connection<T>>, Message<T>&)>;
+  static constexpr size_t kSize = MessageOpCount<T>::value;
+
+  // Return false if op does not fit in the table.
+  bool Register(T op, Handler handler) {
+    size_t index = GetIndex(op);
+    if (index >= kSize) {
+      return false;
+    }
+    if (!handlers_[index]) {
+      count_++;
+    }
+    handlers_[index] = std::move(handler);
+    return true;
+  }
+
+  // Run the handler registered for the op of msg, false if there is none.
+  bool Dispatch(const std::shared_ptr<Connection<T>>& client,
+                Message<T>& msg) const {
+    size_t index = GetIndex(msg.header.op);
+    if (index >= kSize || !handlers_[index]) {
+      return false;
+    }
+    handlers_[index](client, msg);
+    return true;
+  }
+
+  bool empty() const { return count_ == 0; }
+
+ private:
+  static size_t GetIndex(T op) {
+    // negative ops wrap around and fail the bounds check
+    return static_cast<size_t>(op);
+  }
+
+  std::array<Handler, kSize> handlers_;
+  size_t count_ = 0;
+};
+}  // namespace net
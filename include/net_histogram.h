@@ -0,0 +1,172 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include "net_common.h"
+
+namespace net {
+// Log-linear histogram in the spirit of HdrHistogram. Values below kSubBuckets
+// get a bucket each, above that every power of two range is split into
+// kSubBuckets / 2 linear buckets, so a value is reported with a relative error
+// of at most 2 / kSubBuckets (< 1.6%). Record is wait-free and may be called
+// from any thread, the readers see a slightly stale but consistent enough
+// view while recording goes on.
+class Histogram {
+ public:
+  static constexpr int kSubBucketBits = 7;
+  static constexpr uint64_t kSubBuckets = 1ull << kSubBucketBits;
+  static constexpr size_t kBucketCount =
+      kSubBuckets + (64 - kSubBucketBits) * (kSubBuckets / 2);
+
+  Histogram() = default;
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  void Record(uint64_t value) {
+    buckets_[GetIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max &&
+           !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Add every value recorded in other.
+  void Merge(const Histogram& other) {
+    for (size_t i = 0; i < kBucketCount; i++) {
+      uint64_t count = other.buckets_[i].load(std::memory_order_relaxed);
+      if (count > 0) {
+        buckets_[i].fetch_add(count, std::memory_order_relaxed);
+      }
+    }
+    count_.fetch_add(other.Count(), std::memory_order_relaxed);
+    sum_.fetch_add(other.sum_.load(std::memory_order_relaxed),
+                   std::memory_order_relaxed);
+    uint64_t other_max = other.Max();
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (other_max > max && !max_.compare_exchange_weak(
+                                  max, other_max, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Not atomic with respect to concurrent Record calls.
+  void Reset() {
+    for (auto& bucket : buckets_) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t Sum() const { return sum_.load(std::memory_order_relaxed); }
+  uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+  double Mean() const {
+    uint64_t count = Count();
+    return count == 0 ? 0.0 : static_cast<double>(Sum()) / count;
+  }
+
+  // The value at percentile (0 to 100), reported as the highest value of its
+  // bucket but never above Max.
+  uint64_t Percentile(double percentile) const {
+    uint64_t count = Count();
+    if (count == 0) {
+      return 0;
+    }
+    uint64_t target = static_cast<uint64_t>(
+        std::ceil(std::clamp(percentile, 0.0, 100.0) / 100.0 * count));
+    target = std::max<uint64_t>(target, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBucketCount; i++) {
+      seen += buckets_[i].load(std::memory_order_relaxed);
+      if (seen >= target) {
+        return std::min(GetUpperBound(i), Max());
+      }
+    }
+    return Max();
+  }
+
+  // Number of values in bucket index, whose values lie in
+  // [GetLowerBound(index), GetUpperBound(index)].
+  uint64_t GetBucket(size_t index) const {
+    return buckets_[index].load(std::memory_order_relaxed);
+  }
+
+  static size_t GetIndex(uint64_t value) {
+    if (value < kSubBuckets) {
+      return static_cast<size_t>(value);
+    }
+    // value >> shift lies in [kSubBuckets / 2, kSubBuckets)
+    int shift = FloorLog2(value) - kSubBucketBits + 1;
+    return static_cast<size_t>(shift) * (kSubBuckets / 2) +
+           static_cast<size_t>(value >> shift);
+  }
+
+  static uint64_t GetLowerBound(size_t index) {
+    if (index < kSubBuckets) {
+      return index;
+    }
+    size_t shift = (index - kSubBuckets) / (kSubBuckets / 2) + 1;
+    uint64_t sub = (index - kSubBuckets) % (kSubBuckets / 2) + kSubBuckets / 2;
+    return sub << shift;
+  }
+
+  static uint64_t GetUpperBound(size_t index) {
+    if (index < kSubBuckets) {
+      return index;
+    }
+    size_t shift = (index - kSubBuckets) / (kSubBuckets / 2) + 1;
+    return GetLowerBound(index) + ((uint64_t{1} << shift) - 1);
+  }
+
+ private:
+  static int FloorLog2(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(value);
+#else
+    int log = 0;
+    while (value >>= 1) {
+      log++;
+    }
+    return log;
+#endif
+  }
+
+  std::array<std::atomic<uint64_t>, kBucketCount> buckets_{};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+// A Histogram per shard for values recorded on many threads at a high rate.
+// Each thread records into the shard it was given on first use, so threads
+// only share cache lines once there are more of them than shards. Readers
+// merge the shards into a Histogram of their own.
+class ShardedHistogram {
+ public:
+  static constexpr size_t kShards = 8;
+
+  void Record(uint64_t value) { shards_[GetShard()].histogram.Record(value); }
+
+  // Add every value recorded so far to out.
+  void MergeInto(Histogram& out) const {
+    for (const Shard& shard : shards_) {
+      out.Merge(shard.histogram);
+    }
+  }
+
+ private:
+  static size_t GetShard() {
+    static std::atomic<size_t> next_shard{0};
+    thread_local size_t shard =
+        next_shard.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return shard;
+  }
+
+  struct alignas(64) Shard {
+    Histogram histogram;
+  };
+  std::array<Shard, kShards> shards_;
+};
+}  // namespace net
@@ -1,9 +1,29 @@
 #pragma once
+#include <optional>
+#include "net_buffer_pool.h"
 #include "net_common.h"
 
 namespace net {
 template <typename T>
 struct MessageHeader {
+  // Bumped whenever the framing changes. The handshake answer depends on
+  // it, so peers of different versions fail the handshake before a single
+  // frame is exchanged. Version 1 had no flags in data_size.
+  static constexpr uint64_t kProtocolVersion = 2;
+
+  // The two flags below take the top bits of data_size, a peer built before
+  // them would read a flagged frame as a huge body (hence version 2). Bodies
+  // are limited to kSizeMask bytes (1 GiB).
+
+  // Set in data_size when the last 8 bytes of the body are a correlation ID
+  // rather than payload. Only requests and their replies carry one.
+  static constexpr uint32_t kCorrelationFlag = 1u << 31;
+  // data_size of a heartbeat frame, which has no body and is dropped by the
+  // receiving connection instead of being queued.
+  static constexpr uint32_t kHeartbeatFlag = 1u << 30;
+  // The bits of data_size that hold the size.
+  static constexpr uint32_t kSizeMask = ~(kCorrelationFlag | kHeartbeatFlag);
+
   T op{};
   uint32_t data_size = 0;
 };
@@ -14,14 +34,66 @@ struct Message {
   Message() = default;
   Message(T op) { header.op = op; }
 
+  // vector copies element by element for any allocator but std::allocator,
+  // copy the body with memcpy instead
+  Message(const Message<T>& other)
+      : header(other.header), correlation_id(other.correlation_id) {
+#if defined(NET_ENABLE_TRACING)
+    trace_id = other.trace_id;
+#endif
+    CopyBody(other);
+  }
+  Message(Message<T>&&) = default;
+  Message& operator=(const Message<T>& other) {
+    if (this != &other) {
+      header = other.header;
+      correlation_id = other.correlation_id;
+#if defined(NET_ENABLE_TRACING)
+      trace_id = other.trace_id;
+#endif
+      CopyBody(other);
+    }
+    return *this;
+  }
+  Message& operator=(Message<T>&&) = default;
+
   size_t entire_size() const { return sizeof(header) + body.size(); }
   size_t header_size() const { return sizeof(header); }
-  size_t data_size() const { return header.data_size; }
+  size_t data_size() const {
+    return header.data_size & MessageHeader<T>::kSizeMask;
+  }
   void* data_addr() { return body.data(); }
   void* header_addr() { return &header; }
   void set_op(T op) { header.op = op; }
   T get_op() { return header.op; }
 
+  // Append id as the correlation ID trailer, do it after the payload is
+  // complete since operator<< drops the flag again.
+  void attach_correlation_id(uint64_t id) {
+    size_t curr_size = body.size();
+    body.resize(curr_size + sizeof(id));
+    std::memcpy(body.data() + curr_size, &id, sizeof(id));
+    header.data_size = static_cast<uint32_t>(body.size()) |
+                       MessageHeader<T>::kCorrelationFlag;
+    correlation_id = id;
+  }
+
+  // Move the trailer of a received message into correlation_id, which is set
+  // to 0 if there is none.
+  void detach_correlation_id() {
+    correlation_id = 0;
+    if (!(header.data_size & MessageHeader<T>::kCorrelationFlag)) {
+      return;
+    }
+    if (body.size() >= sizeof(correlation_id)) {
+      size_t new_size = body.size() - sizeof(correlation_id);
+      std::memcpy(&correlation_id, body.data() + new_size,
+                  sizeof(correlation_id));
+      body.resize(new_size);
+    }
+    header.data_size = static_cast<uint32_t>(body.size());
+  }
+
   friend std::ostream& operator<<(std::ostream& os, const Message<T>& msg) {
     os << "[Message] Operation: " << int(msg.header.op)
        << ", Size: " << msg.size();
@@ -43,7 +115,7 @@ struct Message {
   friend Message<T>& operator<<(Message<T>& msg, const std::string& str) {
     size_t curr_size = msg.body.size();
     msg.body.resize(msg.body.size() + str.length() + 1 + sizeof(size_t));
-    std::memcpy(msg.body.data() + curr_size, str.data(), str.length());
+    std::memcpy(msg.body.data() + curr_size, str.c_str(), str.length() + 1);
     curr_size += str.length() + 1;
     size_t str_len = str.length();
     std::memcpy(msg.body.data() + curr_size, &str_len, sizeof(size_t));
@@ -77,10 +149,221 @@ struct Message {
     return msg;
   }
 
+  void CopyBody(const Message<T>& other) {
+    body.resize(other.body.size());
+    if (!body.empty()) {
+      std::memcpy(body.data(), other.body.data(), body.size());
+    }
+  }
+
   MessageHeader<T> header;
-  std::vector<uint8_t> body;
+  // drawn from BufferPool, so steady-state traffic does not hit malloc
+  std::vector<uint8_t, PoolAllocator<uint8_t>> body;
+  // not sent as is, see attach_correlation_id
+  uint64_t correlation_id = 0;
+#if defined(NET_ENABLE_TRACING)
+  // Never sent. The trace ID of the incoming message this one was received
+  // as or answers (see Reply), empty for any other message. Writing a message
+  // that has one is recorded under that ID.
+  std::optional<uint64_t> trace_id;
+#endif
 };
 
+namespace detail {
+// Length prefix of strings and vectors in MessageBuilder and Serialize: 7 bits
+// per byte, least significant first, the high bit set on all but the last.
+template <typename Writer>
+void WriteVarint(Writer& writer, uint64_t value) {
+  uint8_t bytes[10];
+  size_t size = 0;
+  while (value >= 0x80) {
+    bytes[size++] = static_cast<uint8_t>(value) | 0x80;
+    value >>= 7;
+  }
+  bytes[size++] = static_cast<uint8_t>(value);
+  writer.WriteBytes(bytes, size);
+}
+
+template <typename Reader>
+uint64_t ReadVarint(Reader& reader) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    const uint8_t* byte = reader.ReadBytes(1);
+    if (!byte) {
+      return 0;
+    }
+    value |= uint64_t(*byte & 0x7f) << shift;
+    if (!(*byte & 0x80)) {
+      return value;
+    }
+  }
+  // longer than any uint64_t, fail the reader
+  reader.ReadBytes(reader.remaining() + 1);
+  return 0;
+}
+
+constexpr size_t VarintSize(uint64_t value) {
+  size_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+}  // namespace detail
+
+// Builds a message front to back into a body that is reserved up front.
+// Trivially copyable fields are copied as they are, strings are written as a
+// varint length followed by their bytes, the same encoding SerializeMessage
+// uses. Read it back in the same order with MessageReader, not with the
+// stack-like operator>> of Message.
+template <typename T>
+class MessageBuilder {
+ public:
+  MessageBuilder(T op, size_t reserve_bytes = 0) {
+    msg_.header.op = op;
+    msg_.body.reserve(reserve_bytes);
+  }
+
+  // Build a message from a fixed list of fields, the body is allocated once
+  // with its exact size (a compile-time constant if there are no strings).
+  template <typename... Fields>
+  static Message<T> Make(T op, const Fields&... fields) {
+    MessageBuilder<T> builder(op, (EncodedSize(fields) + ... + 0));
+    (builder << ... << fields);
+    return builder.Build();
+  }
+
+  template <typename DataType>
+  static constexpr size_t EncodedSize(const DataType&) {
+    static_assert(std::is_trivially_copyable_v<DataType>,
+                  "Data is too complex");
+    return sizeof(DataType);
+  }
+  static size_t EncodedSize(std::string_view str) {
+    return detail::VarintSize(str.size()) + str.size();
+  }
+  static size_t EncodedSize(const std::string& str) {
+    return EncodedSize(std::string_view(str));
+  }
+  static size_t EncodedSize(const char* str) {
+    return EncodedSize(std::string_view(str));
+  }
+
+  template <typename DataType>
+  MessageBuilder<T>& operator<<(const DataType& data) {
+    static_assert(std::is_trivially_copyable_v<DataType>,
+                  "Data is too complex");
+    return WriteBytes(&data, sizeof(DataType));
+  }
+
+  MessageBuilder<T>& operator<<(std::string_view str) {
+    detail::WriteVarint(*this, str.size());
+    return WriteBytes(str.data(), str.size());
+  }
+  MessageBuilder<T>& operator<<(const std::string& str) {
+    return *this << std::string_view(str);
+  }
+  MessageBuilder<T>& operator<<(const char* str) {
+    return *this << std::string_view(str);
+  }
+
+  // Append raw bytes without a length.
+  MessageBuilder<T>& WriteBytes(const void* data, size_t size) {
+    size_t curr_size = msg_.body.size();
+    msg_.body.resize(curr_size + size);
+    if (size > 0) {
+      std::memcpy(msg_.body.data() + curr_size, data, size);
+    }
+    return *this;
+  }
+
+  size_t size() const { return msg_.body.size(); }
+
+  // Finish the header and hand the message over, the builder is left empty.
+  Message<T> Build() {
+    msg_.header.data_size = static_cast<uint32_t>(msg_.body.size());
+    return std::move(msg_);
+  }
+
+ private:
+  Message<T> msg_;
+};
+
+// Reads a message front to back in the order MessageBuilder wrote it, without
+// modifying the message. Strings and byte ranges are views into the body and
+// are only valid as long as the message is. Reading past the end fails the
+// reader and zero-fills the remaining outputs.
+template <typename T>
+class MessageReader {
+ public:
+  MessageReader(const Message<T>& msg)
+      : data_(msg.body.data()), size_(msg.body.size()) {}
+
+  template <typename DataType>
+  MessageReader<T>& operator>>(DataType& data) {
+    static_assert(std::is_trivially_copyable_v<DataType>,
+                  "Data is too complex");
+    const uint8_t* bytes = ReadBytes(sizeof(DataType));
+    if (bytes) {
+      std::memcpy(&data, bytes, sizeof(DataType));
+    } else {
+      std::memset(&data, 0, sizeof(DataType));
+    }
+    return *this;
+  }
+
+  MessageReader<T>& operator>>(std::string_view& str) {
+    str = ReadString();
+    return *this;
+  }
+  // Copies, prefer reading into a std::string_view.
+  MessageReader<T>& operator>>(std::string& str) {
+    str = ReadString();
+    return *this;
+  }
+
+  std::string_view ReadString() {
+    uint64_t str_len = detail::ReadVarint(*this);
+    const uint8_t* bytes = ReadBytes(str_len);
+    if (!bytes) {
+      return {};
+    }
+    return std::string_view(reinterpret_cast<const char*>(bytes), str_len);
+  }
+
+  // View of the next size bytes, nullptr if there are not that many left.
+  const uint8_t* ReadBytes(size_t size) {
+    if (failed_ || size_ - pos_ < size) {
+      failed_ = true;
+      return nullptr;
+    }
+    const uint8_t* bytes = data_ + pos_;
+    pos_ += size;
+    return bytes;
+  }
+
+  bool ok() const { return !failed_; }
+  explicit operator bool() const { return ok(); }
+  size_t remaining() const { return size_ - pos_; }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+  size_t pos_ = 0;
+  bool failed_ = false;
+};
+
+// An immutable, reference-counted message. It is serialized once and can be
+// queued on any number of connections without copying its body.
+template <typename T>
+using SharedMessage = std::shared_ptr<const Message<T>>;
+
+template <typename T>
+SharedMessage<T> MakeSharedMessage(Message<T> msg) {
+  return std::make_shared<const Message<T>>(std::move(msg));
+}
+
 template <typename T>
 class Connection;
 
@@ -88,6 +371,10 @@ template <typename T>
 struct OwnedMessage {
   std::shared_ptr<Connection<T>> remote = nullptr;
   Message<T> msg;
+#if defined(NET_ENABLE_TRACING)
+  // see MakeTraceId
+  uint64_t trace_id = 0;
+#endif
   friend std::ostream& operator<<(std::ostream& os,
                                   const OwnedMessage<T>& msg) {
     os << msg;
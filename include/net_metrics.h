@@ -0,0 +1,201 @@
+#pragma once
+#include <sstream>
+#include "net_common.h"
+#include "net_histogram.h"
+
+namespace net {
+// Why a connection closed, the first reason wins.
+enum class DisconnectReason : uint8_t {
+  kNone,
+  // Disconnect was called on this side
+  kLocal,
+  kPeerClosed,
+  kReadError,
+  kWriteError,
+  kConnectFailed,
+  kHandshakeFailed,
+  // the outgoing queue overflowed under OverflowPolicy::kDisconnect
+  kOverflow,
+  // a handshake, idle, read or write timeout of ConnectionOptions expired
+  kTimeout,
+  // the peer broke the protocol, like a shared memory ring index out of
+  // bounds
+  kProtocolError,
+  kCount,
+};
+
+inline const char* ToString(DisconnectReason reason) {
+  switch (reason) {
+    case DisconnectReason::kNone:
+      return "none";
+    case DisconnectReason::kLocal:
+      return "local";
+    case DisconnectReason::kPeerClosed:
+      return "peer_closed";
+    case DisconnectReason::kReadError:
+      return "read_error";
+    case DisconnectReason::kWriteError:
+      return "write_error";
+    case DisconnectReason::kConnectFailed:
+      return "connect_failed";
+    case DisconnectReason::kHandshakeFailed:
+      return "handshake_failed";
+    case DisconnectReason::kOverflow:
+      return "overflow";
+    case DisconnectReason::kTimeout:
+      return "timeout";
+    case DisconnectReason::kProtocolError:
+      return "protocol_error";
+    default:
+      return "unknown";
+  }
+}
+
+constexpr size_t kDisconnectReasonCount =
+    static_cast<size_t>(DisconnectReason::kCount);
+
+// Counter updated by a single thread and read by any. Add is a relaxed load
+// and store instead of a locked read-modify-write, so it costs about as much
+// as a plain increment.
+class SingleWriterCounter {
+ public:
+  void Add(uint64_t n = 1) {
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+  uint64_t Get() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> value_{0};
+};
+
+// Traffic of one connection, only its I/O thread updates it.
+struct ConnectionMetrics {
+  SingleWriterCounter bytes_in;
+  SingleWriterCounter messages_in;
+  SingleWriterCounter bytes_out;
+  SingleWriterCounter messages_out;
+};
+
+struct ConnectionStats {
+  uint64_t bytes_in = 0;
+  uint64_t messages_in = 0;
+  uint64_t bytes_out = 0;
+  uint64_t messages_out = 0;
+  // outgoing queue
+  uint64_t queued_bytes = 0;
+  uint64_t queued_messages = 0;
+  DisconnectReason disconnect_reason = DisconnectReason::kNone;
+};
+
+// Snapshot of a whole server, see ServerInterface::GetStats.
+struct ServerStats {
+  double uptime_seconds = 0;
+  uint64_t connections_accepted = 0;
+  // denied by OnClientConnect or because the server was full
+  uint64_t connections_denied = 0;
+  uint64_t accept_errors = 0;
+  uint64_t active_connections = 0;
+  uint64_t handshakes_succeeded = 0;
+  uint64_t handshakes_failed = 0;
+  // live connections plus every connection removed so far
+  uint64_t bytes_in = 0;
+  uint64_t messages_in = 0;
+  uint64_t bytes_out = 0;
+  uint64_t messages_out = 0;
+  // summed over the outgoing queues of the live connections
+  uint64_t queued_bytes = 0;
+  uint64_t queued_messages = 0;
+  std::array<uint64_t, kDisconnectReasonCount> disconnects{};
+  // time spent in message handlers, in nanoseconds
+  uint64_t handler_calls = 0;
+  uint64_t handler_total_ns = 0;
+  uint64_t handler_p50_ns = 0;
+  uint64_t handler_p99_ns = 0;
+  uint64_t handler_p999_ns = 0;
+  uint64_t handler_max_ns = 0;
+};
+
+// Server-wide counters, bumped by the I/O threads and the Update thread.
+struct ServerMetrics {
+  std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+  std::atomic<uint64_t> connections_accepted{0};
+  std::atomic<uint64_t> connections_denied{0};
+  std::atomic<uint64_t> accept_errors{0};
+  std::atomic<uint64_t> handshakes_succeeded{0};
+  std::array<std::atomic<uint64_t>, kDisconnectReasonCount> disconnects{};
+  // totals of the connections that have been removed
+  std::atomic<uint64_t> bytes_in{0};
+  std::atomic<uint64_t> messages_in{0};
+  std::atomic<uint64_t> bytes_out{0};
+  std::atomic<uint64_t> messages_out{0};
+  ShardedHistogram handler_latency;
+};
+
+// Render stats in the Prometheus text exposition format, every metric name
+// starts with prefix.
+inline std::string FormatPrometheus(const ServerStats& stats,
+                                    const std::string& prefix = "net") {
+  std::ostringstream out;
+  auto metric = [&](const char* name, const char* type, const char* help,
+                    auto value) {
+    out << "# HELP " << prefix << '_' << name << ' ' << help << '\n'
+        << "# TYPE " << prefix << '_' << name << ' ' << type << '\n'
+        << prefix << '_' << name << ' ' << value << '\n';
+  };
+  metric("uptime_seconds", "gauge", "Seconds since the server was created.",
+         stats.uptime_seconds);
+  metric("connections_accepted_total", "counter", "Accepted connections.",
+         stats.connections_accepted);
+  metric("connections_denied_total", "counter",
+         "Connections denied by OnClientConnect or a full server.",
+         stats.connections_denied);
+  metric("accept_errors_total", "counter", "Failed accepts.",
+         stats.accept_errors);
+  metric("connections_active", "gauge", "Connections not removed yet.",
+         stats.active_connections);
+  metric("handshakes_succeeded_total", "counter", "Validated clients.",
+         stats.handshakes_succeeded);
+  metric("handshakes_failed_total", "counter", "Failed validations.",
+         stats.handshakes_failed);
+  metric("received_bytes_total", "counter", "Bytes received.",
+         stats.bytes_in);
+  metric("received_messages_total", "counter", "Messages received.",
+         stats.messages_in);
+  metric("sent_bytes_total", "counter", "Bytes sent.", stats.bytes_out);
+  metric("sent_messages_total", "counter", "Messages sent.",
+         stats.messages_out);
+  metric("queued_bytes", "gauge", "Bytes waiting in outgoing queues.",
+         stats.queued_bytes);
+  metric("queued_messages", "gauge", "Messages waiting in outgoing queues.",
+         stats.queued_messages);
+
+  out << "# HELP " << prefix
+      << "_disconnects_total Closed connections by reason.\n"
+      << "# TYPE " << prefix << "_disconnects_total counter\n";
+  for (size_t i = 1; i < kDisconnectReasonCount; i++) {
+    out << prefix << "_disconnects_total{reason=\""
+        << ToString(static_cast<DisconnectReason>(i)) << "\"} "
+        << stats.disconnects[i] << '\n';
+  }
+
+  out << "# HELP " << prefix
+      << "_handler_latency_seconds Time spent in message handlers.\n"
+      << "# TYPE " << prefix << "_handler_latency_seconds summary\n";
+  std::pair<const char*, uint64_t> quantiles[] = {
+      {"0.5", stats.handler_p50_ns},
+      {"0.99", stats.handler_p99_ns},
+      {"0.999", stats.handler_p999_ns},
+      {"1", stats.handler_max_ns}};
+  for (const auto& [quantile, ns] : quantiles) {
+    out << prefix << "_handler_latency_seconds{quantile=\"" << quantile
+        << "\"} " << ns / 1e9 << '\n';
+  }
+  out << prefix << "_handler_latency_seconds_sum "
+      << stats.handler_total_ns / 1e9 << '\n'
+      << prefix << "_handler_latency_seconds_count " << stats.handler_calls
+      << '\n';
+  return out.str();
+}
+}  // namespace net
@@ -0,0 +1,165 @@
+#pragma once
+#include "net_buffer_pool.h"
+#include "net_common.h"
+namespace net {
+template <typename T>
+// Lock-free multi-producer single-consumer queue (Vyukov's node based queue).
+// Any thread may push, but only one thread at a time may call front,
+// pop_front, empty, clear and wait_until_non_empty. Producers (and wake) only
+// touch the wakeup mutex when the consumer is actually parked in
+// wait_until_non_empty.
+class MpscQueue {
+ public:
+  MpscQueue() : head_(new Node()), tail_(head_.load()) {}
+  MpscQueue(const MpscQueue<T>&) = delete;
+  MpscQueue(MpscQueue<T>&&) = delete;
+  MpscQueue& operator=(const MpscQueue<T>&) = delete;
+  MpscQueue& operator=(MpscQueue<T>&&) = delete;
+  virtual ~MpscQueue() {
+    clear();
+    delete tail_;
+  }
+
+  void push_back(const T& item) {
+    Node* node = new Node(item);
+    Link(node, node);
+  }
+
+  void push_back(T&& item) {
+    Node* node = new Node(std::move(item));
+    Link(node, node);
+  }
+
+  // Move every item of items to the back of the queue with a single atomic
+  // exchange and leave items empty.
+  void push_batch(std::vector<T>& items) {
+    if (items.empty()) {
+      return;
+    }
+    Node* first = new Node(std::move(items.front()));
+    Node* last = first;
+    for (size_t i = 1; i < items.size(); i++) {
+      Node* node = new Node(std::move(items[i]));
+      last->next.store(node, std::memory_order_relaxed);
+      last = node;
+    }
+    items.clear();
+    Link(first, last);
+  }
+
+  // [Consumer]
+  T& front() { return tail_->next.load(std::memory_order_acquire)->value; }
+
+  // [Consumer]
+  T pop_front() {
+    Node* next = tail_->next.load(std::memory_order_acquire);
+    T result = std::move(next->value);
+    // next becomes the new stub node
+    delete tail_;
+    tail_ = next;
+    return result;
+  }
+
+  // [Consumer] Move up to max_items items to the back of out, return how many
+  // were moved.
+  size_t pop_batch(std::vector<T>& out, size_t max_items) {
+    size_t count = 0;
+    while (count < max_items && !empty()) {
+      out.push_back(pop_front());
+      count++;
+    }
+    return count;
+  }
+
+  // [Consumer] Move every item to the back of out, return how many were
+  // moved.
+  size_t drain(std::vector<T>& out) {
+    return pop_batch(out, std::numeric_limits<size_t>::max());
+  }
+
+  // [Consumer] A push that is still being linked counts as empty.
+  bool empty() const {
+    return tail_->next.load(std::memory_order_acquire) == nullptr;
+  }
+
+  // [Consumer]
+  void clear() {
+    while (!empty()) {
+      pop_front();
+    }
+  }
+
+  // [Consumer] Also returns, once, after wake.
+  void wait_until_non_empty() {
+    for (int i = 0; i < kSpinCount; i++) {
+      if (!empty() || woken_.load(std::memory_order_relaxed)) {
+        woken_.store(false, std::memory_order_relaxed);
+        return;
+      }
+    }
+
+    std::unique_lock<std::mutex> ul(mux_blocking_);
+    sleeping_.store(true, std::memory_order_relaxed);
+    // pairs with the fence in Link and wake: either the producer sees
+    // sleeping_ or we see its node (or woken_)
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (empty() && !woken_.load(std::memory_order_relaxed)) {
+      cv_blocking_.wait(ul);
+    }
+    woken_.store(false, std::memory_order_relaxed);
+    sleeping_.store(false, std::memory_order_relaxed);
+  }
+
+  // Make the current or the next wait_until_non_empty return even though
+  // nothing was pushed. Any thread may call it.
+  void wake() {
+    woken_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed)) {
+      std::unique_lock<std::mutex> ul(mux_blocking_);
+      cv_blocking_.notify_one();
+    }
+  }
+
+ protected:
+  struct Node {
+    Node() = default;
+    template <typename U>
+    explicit Node(U&& item) : value(std::forward<U>(item)) {}
+
+    static void* operator new(size_t size) {
+      return BufferPool::Allocate(size);
+    }
+    static void operator delete(void* node, size_t size) {
+      BufferPool::Deallocate(node, size);
+    }
+
+    std::atomic<Node*> next{nullptr};
+    T value;
+  };
+
+  static constexpr int kSpinCount = 64;
+
+  // Append the already linked chain [first, last].
+  void Link(Node* first, Node* last) {
+    Node* prev = head_.exchange(last, std::memory_order_acq_rel);
+    prev->next.store(first, std::memory_order_release);
+
+    // unblock wait_until_non_empty, only if the consumer is parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed)) {
+      std::unique_lock<std::mutex> ul(mux_blocking_);
+      cv_blocking_.notify_one();
+    }
+  }
+
+  // producers push at head_, the consumer pops after tail_
+  alignas(64) std::atomic<Node*> head_;
+  alignas(64) Node* tail_;
+
+  std::atomic<bool> sleeping_{false};
+  std::atomic<bool> woken_{false};
+  std::condition_variable cv_blocking_;
+  std::mutex mux_blocking_;
+};
+}  // namespace net
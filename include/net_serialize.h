@@ -0,0 +1,461 @@
+#pragma once
+#include <array>
+#include <tuple>
+#include "net_common.h"
+#include "net_message.h"
+
+// Declare the fields of a struct that Serialize should encode, in declaration
+// order. Only needed for structs that are not aggregates, or have more than
+// kMaxReflectedFields fields:
+//   struct Player {
+//     uint32_t id;
+//     std::string name;
+//     NET_SERIALIZE(id, name)
+//   };
+#define NET_SERIALIZE(...)                                  \
+  auto NetFields() { return std::tie(__VA_ARGS__); }       \
+  auto NetFields() const { return std::tie(__VA_ARGS__); }
+
+namespace net {
+// Aggregates with up to this many fields are serialized without declaring
+// their fields. C arrays are not supported as fields, use std::array.
+constexpr size_t kMaxReflectedFields = 32;
+
+template <typename Writer, typename S>
+void Serialize(Writer& writer, const S& value);
+template <typename Reader, typename S>
+void Deserialize(Reader& reader, S& value);
+
+namespace detail {
+// Converts to any field type, used to count the fields of an aggregate.
+struct AnyField {
+  template <typename U>
+  operator U() const;
+};
+
+template <typename S, typename... Args>
+auto TryBraceInit(int) -> decltype(S{std::declval<Args>()...}, std::true_type{});
+template <typename S, typename... Args>
+std::false_type TryBraceInit(...);
+
+// The number of fields of an aggregate is the largest number of initializers
+// it can be brace-initialized with.
+template <typename S, typename... Args>
+constexpr size_t CountFields() {
+  if constexpr (sizeof...(Args) > kMaxReflectedFields) {
+    return sizeof...(Args);
+  } else if constexpr (decltype(TryBraceInit<S, Args..., AnyField>(0))::value) {
+    return CountFields<S, Args..., AnyField>();
+  } else {
+    return sizeof...(Args);
+  }
+}
+
+template <typename S, typename = void>
+struct HasNetFields : std::false_type {};
+template <typename S>
+struct HasNetFields<S, std::void_t<decltype(std::declval<S&>().NetFields())>>
+    : std::true_type {};
+
+template <typename S>
+struct IsVector : std::false_type {};
+template <typename U, typename Alloc>
+struct IsVector<std::vector<U, Alloc>> : std::true_type {};
+
+template <typename S>
+struct IsStdArray : std::false_type {};
+template <typename U, size_t N>
+struct IsStdArray<std::array<U, N>> : std::true_type {};
+
+// A tuple of references to every field of an aggregate, in declaration order.
+template <typename S>
+auto ReflectFields(S& value) {
+  constexpr size_t kCount = CountFields<std::remove_const_t<S>>();
+  if constexpr (kCount == 1) {
+    auto& [f0] = value;
+    return std::tie(f0);
+  } else if constexpr (kCount == 2) {
+    auto& [f0, f1] = value;
+    return std::tie(f0, f1);
+  } else if constexpr (kCount == 3) {
+    auto& [f0, f1, f2] = value;
+    return std::tie(f0, f1, f2);
+  } else if constexpr (kCount == 4) {
+    auto& [f0, f1, f2, f3] = value;
+    return std::tie(f0, f1, f2, f3);
+  } else if constexpr (kCount == 5) {
+    auto& [f0, f1, f2, f3, f4] = value;
+    return std::tie(f0, f1, f2, f3, f4);
+  } else if constexpr (kCount == 6) {
+    auto& [f0, f1, f2, f3, f4, f5] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5);
+  } else if constexpr (kCount == 7) {
+    auto& [f0, f1, f2, f3, f4, f5, f6] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6);
+  } else if constexpr (kCount == 8) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7);
+  } else if constexpr (kCount == 9) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8);
+  } else if constexpr (kCount == 10) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9);
+  } else if constexpr (kCount == 11) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10);
+  } else if constexpr (kCount == 12) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11);
+  } else if constexpr (kCount == 13) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12);
+  } else if constexpr (kCount == 14) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13);
+  } else if constexpr (kCount == 15) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+           f14] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14);
+  } else if constexpr (kCount == 16) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14,
+           f15] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15);
+  } else if constexpr (kCount == 17) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16);
+  } else if constexpr (kCount == 18) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17);
+  } else if constexpr (kCount == 19) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18);
+  } else if constexpr (kCount == 20) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19);
+  } else if constexpr (kCount == 21) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19, f20] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19, f20);
+  } else if constexpr (kCount == 22) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19, f20, f21] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19, f20, f21);
+  } else if constexpr (kCount == 23) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19, f20, f21, f22] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19, f20, f21, f22);
+  } else if constexpr (kCount == 24) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19, f20, f21, f22, f23] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19, f20, f21, f22, f23);
+  } else if constexpr (kCount == 25) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19, f20, f21, f22, f23, f24] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19, f20, f21, f22, f23, f24);
+  } else if constexpr (kCount == 26) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19, f20, f21, f22, f23, f24, f25] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19, f20, f21, f22, f23, f24, f25);
+  } else if constexpr (kCount == 27) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19, f20, f21, f22, f23, f24, f25, f26] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19, f20, f21, f22, f23, f24, f25,
+                    f26);
+  } else if constexpr (kCount == 28) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19, f20, f21, f22, f23, f24, f25, f26, f27] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19, f20, f21, f22, f23, f24, f25,
+                    f26, f27);
+  } else if constexpr (kCount == 29) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19, f20, f21, f22, f23, f24, f25, f26, f27,
+           f28] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19, f20, f21, f22, f23, f24, f25,
+                    f26, f27, f28);
+  } else if constexpr (kCount == 30) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19, f20, f21, f22, f23, f24, f25, f26, f27, f28,
+           f29] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19, f20, f21, f22, f23, f24, f25,
+                    f26, f27, f28, f29);
+  } else if constexpr (kCount == 31) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19, f20, f21, f22, f23, f24, f25, f26, f27, f28, f29,
+           f30] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19, f20, f21, f22, f23, f24, f25,
+                    f26, f27, f28, f29, f30);
+  } else if constexpr (kCount == 32) {
+    auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15,
+           f16, f17, f18, f19, f20, f21, f22, f23, f24, f25, f26, f27, f28, f29,
+           f30, f31] = value;
+    return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13,
+                    f14, f15, f16, f17, f18, f19, f20, f21, f22, f23, f24, f25,
+                    f26, f27, f28, f29, f30, f31);
+  } else {
+    static_assert(kCount <= kMaxReflectedFields,
+                  "Too many fields, declare them with NET_SERIALIZE");
+    return std::tie();
+  }
+}
+
+// Writer that only adds up the encoded size.
+struct SizeCounter {
+  void WriteBytes(const void*, size_t bytes) { size += bytes; }
+  size_t size = 0;
+};
+
+// Sum of the sizes of the first Count fields.
+template <size_t Count, typename Tuple>
+constexpr size_t SumFieldSizes() {
+  if constexpr (Count == 0) {
+    return 0;
+  } else {
+    return sizeof(std::decay_t<std::tuple_element_t<Count - 1, Tuple>>) +
+           SumFieldSizes<Count - 1, Tuple>();
+  }
+}
+
+template <typename S>
+constexpr bool IsPaddingFree();
+
+template <typename Tuple, size_t... Indices>
+constexpr bool AreFieldsPaddingFree(std::index_sequence<Indices...>) {
+  return (IsPaddingFree<std::decay_t<std::tuple_element_t<Indices, Tuple>>>() &&
+          ...);
+}
+
+// True if every byte of S belongs to a value, so copying it as one block
+// puts no padding on the wire. Scalars (floating point included), types with
+// unique object representations, and arrays and aggregates made only of
+// such types without gaps between them.
+template <typename S>
+constexpr bool IsPaddingFree() {
+  if constexpr (!std::is_trivially_copyable_v<S>) {
+    return false;
+  } else if constexpr (std::is_scalar_v<S> ||
+                       std::has_unique_object_representations_v<S>) {
+    return true;
+  } else if constexpr (IsStdArray<S>::value) {
+    using Element = typename S::value_type;
+    return sizeof(S) == std::tuple_size_v<S> * sizeof(Element) &&
+           IsPaddingFree<Element>();
+  } else if constexpr (std::is_aggregate_v<S> && !HasNetFields<S>::value &&
+                       CountFields<S>() <= kMaxReflectedFields) {
+    using Fields = decltype(ReflectFields(std::declval<S&>()));
+    constexpr size_t kCount = std::tuple_size_v<Fields>;
+    return SumFieldSizes<kCount, Fields>() == sizeof(S) &&
+           AreFieldsPaddingFree<Fields>(std::make_index_sequence<kCount>());
+  } else {
+    return false;
+  }
+}
+
+template <typename Tuple, size_t Index = 0>
+constexpr size_t CountPaddingFreePrefix() {
+  if constexpr (Index < std::tuple_size_v<Tuple>) {
+    using Field = std::decay_t<std::tuple_element_t<Index, Tuple>>;
+    if constexpr (IsPaddingFree<Field>()) {
+      return CountPaddingFreePrefix<Tuple, Index + 1>();
+    } else {
+      return Index;
+    }
+  } else {
+    return Index;
+  }
+}
+
+// Byte range [first field, end of field Count - 1] of an aggregate's leading
+// padding-free fields, or an empty range if there is padding between them. Without padding the block holds exactly the bytes the fields encode
+// to one by one, so copying it does not change the wire format and leaks no
+// uninitialized bytes.
+template <size_t Count, typename Tuple>
+std::pair<const void*, size_t> GetPrefixBlock(const Tuple& fields) {
+  const auto* first =
+      reinterpret_cast<const uint8_t*>(&std::get<0>(fields));
+  const auto& last = std::get<Count - 1>(fields);
+  const auto* end = reinterpret_cast<const uint8_t*>(&last) + sizeof(last);
+  size_t size = static_cast<size_t>(end - first);
+  if (size != SumFieldSizes<Count, Tuple>()) {
+    return {first, 0};
+  }
+  return {first, size};
+}
+
+// Serialize the fields from Index on.
+template <size_t Index, typename Writer, typename Tuple>
+void SerializeFrom(Writer& writer, const Tuple& fields) {
+  if constexpr (Index < std::tuple_size_v<Tuple>) {
+    Serialize(writer, std::get<Index>(fields));
+    SerializeFrom<Index + 1>(writer, fields);
+  }
+}
+
+// Deserialize the fields from Index on.
+template <size_t Index, typename Reader, typename Tuple>
+void DeserializeFrom(Reader& reader, const Tuple& fields) {
+  if constexpr (Index < std::tuple_size_v<Tuple>) {
+    Deserialize(reader, std::get<Index>(fields));
+    DeserializeFrom<Index + 1>(reader, fields);
+  }
+}
+}  // namespace detail
+
+// Append value to writer (MessageBuilder, or anything with WriteBytes).
+// Values without padding (see IsPaddingFree) are copied as they are, strings
+// and vectors are written as a varint length followed by their contents, and
+// structs and arrays element by element, so padding never goes on the wire.
+// The leading padding-free fields of an aggregate are copied in one block
+// when there is no padding between them.
+template <typename Writer, typename S>
+void Serialize(Writer& writer, const S& value) {
+  if constexpr (detail::IsPaddingFree<S>()) {
+    writer.WriteBytes(&value, sizeof(S));
+  } else if constexpr (std::is_same_v<S, std::string>) {
+    detail::WriteVarint(writer, value.size());
+    writer.WriteBytes(value.data(), value.size());
+  } else if constexpr (detail::IsVector<S>::value) {
+    using Element = typename S::value_type;
+    detail::WriteVarint(writer, value.size());
+    if constexpr (detail::IsPaddingFree<Element>()) {
+      writer.WriteBytes(value.data(), value.size() * sizeof(Element));
+    } else {
+      for (const Element& element : value) {
+        Serialize(writer, element);
+      }
+    }
+  } else if constexpr (detail::IsStdArray<S>::value) {
+    for (const auto& element : value) {
+      Serialize(writer, element);
+    }
+  } else if constexpr (detail::HasNetFields<S>::value) {
+    std::apply([&writer](const auto&... fields) {
+      (Serialize(writer, fields), ...);
+    }, value.NetFields());
+  } else {
+    static_assert(std::is_aggregate_v<S>,
+                  "Declare the fields to serialize with NET_SERIALIZE");
+    auto fields = detail::ReflectFields(value);
+    constexpr size_t kPrefix =
+        detail::CountPaddingFreePrefix<decltype(fields)>();
+    if constexpr (kPrefix > 0) {
+      auto block = detail::GetPrefixBlock<kPrefix>(fields);
+      if (block.second > 0) {
+        writer.WriteBytes(block.first, block.second);
+        detail::SerializeFrom<kPrefix>(writer, fields);
+        return;
+      }
+    }
+    detail::SerializeFrom<0>(writer, fields);
+  }
+}
+
+// Read value back from reader (MessageReader, or anything with ReadBytes and
+// remaining). On malformed input the reader fails and value is left partially
+// filled.
+template <typename Reader, typename S>
+void Deserialize(Reader& reader, S& value) {
+  if constexpr (detail::IsPaddingFree<S>()) {
+    const uint8_t* bytes = reader.ReadBytes(sizeof(S));
+    if (bytes) {
+      std::memcpy(&value, bytes, sizeof(S));
+    }
+  } else if constexpr (std::is_same_v<S, std::string>) {
+    uint64_t size = detail::ReadVarint(reader);
+    const uint8_t* bytes = reader.ReadBytes(size);
+    if (bytes) {
+      value.assign(reinterpret_cast<const char*>(bytes), size);
+    }
+  } else if constexpr (detail::IsVector<S>::value) {
+    using Element = typename S::value_type;
+    uint64_t size = detail::ReadVarint(reader);
+    // every element takes at least one byte, do not trust larger counts
+    if (size > reader.remaining()) {
+      reader.ReadBytes(reader.remaining() + 1);
+      return;
+    }
+    if constexpr (detail::IsPaddingFree<Element>()) {
+      const uint8_t* bytes = reader.ReadBytes(size * sizeof(Element));
+      if (bytes) {
+        value.resize(size);
+        std::memcpy(value.data(), bytes, size * sizeof(Element));
+      }
+    } else {
+      value.resize(size);
+      for (Element& element : value) {
+        Deserialize(reader, element);
+      }
+    }
+  } else if constexpr (detail::IsStdArray<S>::value) {
+    for (auto& element : value) {
+      Deserialize(reader, element);
+    }
+  } else if constexpr (detail::HasNetFields<S>::value) {
+    std::apply([&reader](auto&... fields) { (Deserialize(reader, fields), ...); },
+               value.NetFields());
+  } else {
+    static_assert(std::is_aggregate_v<S>,
+                  "Declare the fields to serialize with NET_SERIALIZE");
+    auto fields = detail::ReflectFields(value);
+    constexpr size_t kPrefix =
+        detail::CountPaddingFreePrefix<decltype(fields)>();
+    if constexpr (kPrefix > 0) {
+      auto block = detail::GetPrefixBlock<kPrefix>(fields);
+      if (block.second > 0) {
+        const uint8_t* bytes = reader.ReadBytes(block.second);
+        if (bytes) {
+          std::memcpy(const_cast<void*>(block.first), bytes, block.second);
+        }
+        detail::DeserializeFrom<kPrefix>(reader, fields);
+        return;
+      }
+    }
+    detail::DeserializeFrom<0>(reader, fields);
+  }
+}
+
+// Exact number of bytes Serialize writes for value.
+template <typename S>
+size_t SerializedSize(const S& value) {
+  detail::SizeCounter counter;
+  Serialize(counter, value);
+  return counter.size;
+}
+
+// Build a message whose body is value, allocated once with its exact size.
+template <typename T, typename S>
+Message<T> SerializeMessage(T op, const S& value) {
+  MessageBuilder<T> builder(op, SerializedSize(value));
+  Serialize(builder, value);
+  return builder.Build();
+}
+
+// Read value from the body of msg, false if the body is malformed.
+template <typename T, typename S>
+bool DeserializeMessage(const Message<T>& msg, S& value) {
+  MessageReader<T> reader(msg);
+  Deserialize(reader, value);
+  return reader.ok();
+}
+}  // namespace net
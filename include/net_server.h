@@ -1,24 +1,44 @@
 #pragma once
+#include <cstdio>
+#include <fstream>
+#include <unordered_map>
 #include "net_common.h"
 #include "net_connection.h"
+#include "net_connection_registry.h"
+#include "net_context_pool.h"
+#include "net_dispatch.h"
 #include "net_message.h"
+#include "net_metrics.h"
+#include "net_topic_registry.h"
+#include "net_trace.h"
+#include "net_worker_pool.h"
 
 namespace net {
 template <typename T>
 class ServerInterface {
  public:
-  // Create the asio_context_ and the acceptor (which is essentially a socket
+  // Create the io_contexts and the acceptor (which is essentially a socket
   // responsible for using async_accept to create sockets for connecting with
-  // various clients).
-  ServerInterface(uint16_t port)
+  // various clients). Connections are spread round-robin over io_threads
+  // contexts, each of them run by its own thread.
+  ServerInterface(uint16_t port, const ConnectionOptions& options = {},
+                  size_t io_threads = 1)
       // In fact:
       // - asio relies on WinSock2.h.(in windows.)
       // - asio::ip::tcp::v4() corresponds to the AF_INET macro
       // - asio::ip::tcp::endpoint is essentially sockaddr_in
       // - asio::ip::tcp::acceptor is effectively equivalent to calling socket,
       //   bind, listen, and other preparatory steps, enabling direct listening.
-      : asio_acceptor_(asio_context_,
-                       asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)) {}
+      : context_pool_(io_threads),
+        topics_(context_pool_),
+        asio_acceptor_(context_pool_.GetContext(0),
+                       asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)),
+        options_(options) {
+    for (size_t i = 0; i < context_pool_.size(); i++) {
+      timing_wheels_.push_back(std::make_unique<TimingWheel>(
+          context_pool_.GetContext(i), options_.timer_tick));
+    }
+  }
 
   virtual ~ServerInterface() { Stop(); }
 
@@ -26,7 +46,8 @@ class ServerInterface {
   // into Connections.
   void Start() {
     try {
-      thread_context_ = std::thread([this]() { asio_context_.run(); });
+      stopped_ = false;
+      context_pool_.Start();
       WaitForClientConnection();
       std::cout << "[Server] Started." << std::endl;
     } catch (std::exception& e) {
@@ -34,103 +55,440 @@ class ServerInterface {
     }
   }
 
+  // Also makes a blocked Update return, and every later one return at once,
+  // so a thread looping on Update can check IsStopped and exit.
   void Stop() {
-    asio_context_.stop();
-    if (thread_context_.joinable()) {
-      thread_context_.join();
+    stopped_ = true;
+    message_in_.wake();
+    // the workers may still be sending on connections
+    workers_.reset();
+    context_pool_.Stop();
+    if (datagrams_) {
+      datagrams_->Close();
+    }
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    for (const std::unique_ptr<LocalListener>& listener : local_listeners_) {
+      listener->acceptor.close();
+      std::remove(listener->path.c_str());
     }
+    local_listeners_.clear();
+#endif
     std::cout << "[Server] Stopped.\n";
   }
 
-  void WaitForClientConnection() {
-    asio_acceptor_.async_accept([this](std::error_code ec,
-                                       asio::ip::tcp::socket socket) {
-      if (!ec) {
-        std::cout << "[Server] New Connection: " << socket.remote_endpoint()
-                  << '\n';
-        // wrap the socket into a connection and point to it using shared_ptr
-        std::shared_ptr<Connection<T>> new_conn =
-            std::make_shared<Connection<T>>(Connection<T>::Owner::kServer,
-                                            asio_context_, std::move(socket),
-                                            message_in_);
-        // give the server a chance to deny connection
-        if (OnClientConnect(new_conn)) {
-          connections_.push_back(std::move(new_conn));
-          connections_.back()->ConnectToClient(id_counter_++);
-          std::cout << "[Server] Connection " << connections_.back()->GetID()
-                    << " Approved\n";
-        } else {
-          std::cout << "[Server] Connection Denied\n";
-        }
-      } else {
-        std::cout << "[Server] New Connection Error:" << ec.message() << '\n';
-      }
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  // Also accept clients on the Unix domain socket at path, alongside the TCP
+  // port. Same-host clients connecting through ClientInterface::ConnectLocal
+  // skip the TCP/IP stack. A file left behind at path is replaced, and
+  // removed again by Stop.
+  void ListenLocal(const std::string& path) { ListenOn(path, false); }
+#endif
 
-      WaitForClientConnection();
-    });
+#if defined(NET_HAS_SHARED_MEMORY)
+  // Like ListenLocal, but the clients connecting through
+  // ClientInterface::ConnectSharedMemory exchange their messages through
+  // rings in shared memory (ConnectionOptions::shared_memory_ring_bytes in
+  // each direction), the socket only carries the handshake. Linux only.
+  void ListenSharedMemory(const std::string& path) { ListenOn(path, true); }
+#endif
+
+  // Also receive datagrams on UDP port, and send the messages with one of
+  // unreliable_ops to the clients that registered through
+  // ClientInterface::UseDatagrams as datagrams instead of over their TCP
+  // connection. They may be lost or reordered, stale ones are dropped, and
+  // they reach OnMessageArrive like any other message. Call it before Start.
+  void ListenDatagrams(uint16_t port, const std::vector<T>& unreliable_ops,
+                       size_t max_datagram_size = kDefaultMaxDatagramSize) {
+    datagrams_ = std::make_unique<DatagramChannel<T>>(
+        context_pool_.GetContext(0),
+        [this](const DatagramHeader& header) {
+          return FindDatagramSender(header);
+        },
+        max_datagram_size);
+    for (T op : unreliable_ops) {
+      datagrams_->SetUnreliable(op);
+    }
+    // the same addresses the TCP acceptor listens on
+    datagrams_->Listen(asio::ip::udp::endpoint(
+        asio_acceptor_.local_endpoint().address(), port));
+  }
+
+  DatagramStats GetDatagramStats() const {
+    return datagrams_ ? datagrams_->GetStats() : DatagramStats();
+  }
+
+  // Hand the messages Update pops to a pool of worker threads instead of
+  // running OnMessageArrive on the calling thread. The messages of a client
+  // are still handled in order, but OnMessageArrive runs concurrently for
+  // different clients. OnMessagesArrive is bypassed. Call it before the first
+  // Update, and Stop before the derived server is destroyed.
+  void StartWorkers(const WorkerPoolOptions& options = {}) {
+    workers_ = std::make_unique<WorkerPool<T>>(
+        options, [this](OwnedMessage<T>& message) {
+          TimeHandler(
+              [&]() { OnMessageArrive(message.remote, message.msg); });
+          if constexpr (kTracingEnabled) {
+            Trace(TracePoint::kHandled, message.trace_id);
+          }
+          if (options_.IsCorked()) {
+            message.remote->Flush();
+          }
+        });
+  }
+
+  // Run handler for every message with the given op directly on the I/O
+  // thread that decoded it, instead of queueing it for Update. Handlers of
+  // one connection run in order, handlers of different connections may run
+  // concurrently. Ops without a handler still go through Update. Call it
+  // before Start, return false if op does not fit in the table.
+  bool RegisterHandler(T op, typename DispatchTable<T>::Handler handler) {
+    return inline_handlers_.Register(op, std::move(handler));
+  }
+
+  void WaitForClientConnection() { WaitForClientConnection(asio_acceptor_); }
+
+  // Accept on a TCP or a Unix domain acceptor, the connections are the same.
+  template <typename Acceptor>
+  void WaitForClientConnection(Acceptor& acceptor,
+                               bool shared_memory = false) {
+    // the accepted socket is bound to the context that will run the connection
+    asio::io_context& conn_context = context_pool_.GetNextContext();
+    acceptor.async_accept(
+        conn_context,
+        [this, &acceptor, &conn_context, shared_memory](
+            std::error_code ec,
+            typename Acceptor::protocol_type::socket socket) {
+          if (!ec) {
+            metrics_.connections_accepted++;
+            // wrap the socket into a connection and point to it using
+            // shared_ptr
+            std::shared_ptr<Connection<T>> new_conn =
+                std::make_shared<Connection<T>>(
+                    Connection<T>::Owner::kServer, conn_context,
+                    typename Connection<T>::Socket(std::move(socket)),
+                    message_in_, options_);
+#if defined(NET_HAS_SHARED_MEMORY)
+            if (shared_memory) {
+              new_conn->UseSharedMemory();
+            }
+#endif
+            if (datagrams_) {
+              new_conn->SetDatagramChannel(datagrams_.get());
+            }
+            new_conn->SetTimingWheel(GetTimingWheel(conn_context));
+            std::cout << "[Server] New Connection: "
+                      << new_conn->RemoteEndpoint() << '\n';
+            new_conn->SetWritableHandler(
+                [this](std::shared_ptr<Connection<T>> client) {
+                  OnClientWritable(client);
+                });
+            if (!inline_handlers_.empty()) {
+              new_conn->SetInlineHandler(
+                  [this](std::shared_ptr<Connection<T>> client,
+                         Message<T>& msg) {
+                    bool handled = false;
+                    TimeHandler([&]() {
+                      handled = inline_handlers_.Dispatch(client, msg);
+                    });
+                    return handled;
+                  });
+            }
+            // the connection reports its own closure, RemoveClient only
+            // has to look at the ones that did
+            new_conn->SetCloseHandler(
+                [this](std::shared_ptr<Connection<T>> client) {
+                  size_t reason =
+                      static_cast<size_t>(client->GetDisconnectReason());
+                  metrics_.disconnects[reason]++;
+                  closed_ids_.push_back(client->GetID());
+                  // Update has to remove it even if no message comes in
+                  message_in_.wake();
+                });
+            new_conn->SetValidatedHandler(
+                [this](std::shared_ptr<Connection<T>> client) {
+                  metrics_.handshakes_succeeded++;
+                  OnClientValidationSuccess(client);
+                });
+            // the rest runs on the connection's own I/O thread, so it
+            // starts there and a Disconnect from OnClientConnect runs after
+            // ConnectToClient assigned the ID
+            asio::post(conn_context, [this, new_conn]() {
+              // give the server a chance to deny connection
+              if (OnClientConnect(new_conn)) {
+                uint32_t id = connections_.Insert(new_conn);
+                if (id != ConnectionRegistry<T>::kInvalidId) {
+                  new_conn->ConnectToClient(id);
+                  if (datagrams_) {
+                    // the token is only known from here on
+                    std::unique_lock<std::mutex> lock(datagram_tokens_mux_);
+                    datagram_tokens_[new_conn->GetDatagramToken()] = new_conn;
+                  }
+                  std::cout << "[Server] Connection " << id << " Approved\n";
+                } else {
+                  metrics_.connections_denied++;
+                  std::cout << "[Server] Connection Denied, server is full\n";
+                }
+              } else {
+                metrics_.connections_denied++;
+                std::cout << "[Server] Connection Denied\n";
+              }
+            });
+          } else {
+            metrics_.accept_errors++;
+            std::cout << "[Server] New Connection Error:" << ec.message()
+                      << '\n';
+          }
+
+          WaitForClientConnection(acceptor, shared_memory);
+        });
   }
 
+  bool IsStopped() const { return stopped_; }
+
   // Specify the number of messages to process.
   void Update(
       unsigned int max_messages = std::numeric_limits<unsigned int>::max()) {
-    // block main thread until message_in_ is not empty
+    // block main thread until message_in_ is not empty, a connection
+    // closed or the server stopped
+    if (stopped_) {
+      return;
+    }
     message_in_.wait_until_non_empty();
+    if (stopped_) {
+      return;
+    }
 
-    size_t message_count = 0;
-    while (message_count < max_messages && !message_in_.empty()) {
-      auto msg = message_in_.pop_front();
-      OnMessageArrive(msg.remote, msg.msg);
-      message_count++;
+    // take the whole batch under a single lock, then process it
+    message_in_.pop_batch(update_batch_, max_messages);
+    if constexpr (kTracingEnabled) {
+      for (const OwnedMessage<T>& message : update_batch_) {
+        Trace(TracePoint::kDequeued, message.trace_id);
+      }
+    }
+    if (update_batch_.empty()) {
+      // woken up for the closed connections only
+    } else if (workers_) {
+      workers_->SubmitBatch(update_batch_);
+    } else {
+      OnMessagesArrive(update_batch_);
+      if (options_.IsCorked()) {
+        // whatever the batch sent back goes out now, Flush merges the calls
+        // for the same client
+        for (const OwnedMessage<T>& message : update_batch_) {
+          message.remote->Flush();
+        }
+      }
+      update_batch_.clear();
     }
 
     RemoveClient();
   }
 
+  // Drop the connections that closed since the last call, O(closed
+  // connections) rather than O(all connections).
   void RemoveClient() {
-    bool invalid_client_exists = false;
-
-    for (auto& client : connections_) {
-      // if client == nullptr or disconnected
-      if (!(client && client->IsConnected())) {
+    closed_ids_.drain(closed_batch_);
+    for (uint32_t id : closed_batch_) {
+      std::shared_ptr<Connection<T>> client;
+      {
+        // GetStats must not see the connection both live and folded in
+        std::unique_lock<std::mutex> lock(stats_mux_);
+        client = connections_.Remove(id);
+        if (client) {
+          ConnectionStats stats = client->GetStats();
+          metrics_.bytes_in += stats.bytes_in;
+          metrics_.messages_in += stats.messages_in;
+          metrics_.bytes_out += stats.bytes_out;
+          metrics_.messages_out += stats.messages_out;
+        }
+      }
+      topics_.UnsubscribeAll(id);
+      if (workers_) {
+        workers_->Forget(id);
+      }
+      if (client && datagrams_) {
+        std::unique_lock<std::mutex> lock(datagram_tokens_mux_);
+        datagram_tokens_.erase(client->GetDatagramToken());
+      }
+      if (client) {
         OnClientDisconnect(client);
-        client.reset();  // Set to nullptr to indicate that this client is dead.
-        invalid_client_exists = true;
       }
     }
+    closed_batch_.clear();
+  }
+
+  // Counters of the whole server, safe to call from any thread. Traffic
+  // counters include the connections that have been removed.
+  ServerStats GetStats() const {
+    ServerStats stats;
+    stats.uptime_seconds = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() -
+                               metrics_.start_time)
+                               .count();
+    stats.connections_accepted = metrics_.connections_accepted;
+    stats.connections_denied = metrics_.connections_denied;
+    stats.accept_errors = metrics_.accept_errors;
+    stats.handshakes_succeeded = metrics_.handshakes_succeeded;
+    for (size_t i = 0; i < kDisconnectReasonCount; i++) {
+      stats.disconnects[i] = metrics_.disconnects[i];
+    }
+    stats.handshakes_failed = stats.disconnects[static_cast<size_t>(
+        DisconnectReason::kHandshakeFailed)];
 
-    // remove dead connection;
-    if (invalid_client_exists) {
-      // erase remove idiom
-      connections_.erase(
-          std::remove(connections_.begin(), connections_.end(), nullptr),
-          connections_.end());
+    {
+      std::unique_lock<std::mutex> lock(stats_mux_);
+      stats.bytes_in = metrics_.bytes_in;
+      stats.messages_in = metrics_.messages_in;
+      stats.bytes_out = metrics_.bytes_out;
+      stats.messages_out = metrics_.messages_out;
+      connections_.ForEach([&](const std::shared_ptr<Connection<T>>& client) {
+        ConnectionStats client_stats = client->GetStats();
+        stats.active_connections++;
+        stats.bytes_in += client_stats.bytes_in;
+        stats.messages_in += client_stats.messages_in;
+        stats.bytes_out += client_stats.bytes_out;
+        stats.messages_out += client_stats.messages_out;
+        stats.queued_bytes += client_stats.queued_bytes;
+        stats.queued_messages += client_stats.queued_messages;
+      });
     }
+
+    Histogram latency;
+    metrics_.handler_latency.MergeInto(latency);
+    stats.handler_calls = latency.Count();
+    stats.handler_total_ns = latency.Sum();
+    stats.handler_p50_ns = latency.Percentile(50);
+    stats.handler_p99_ns = latency.Percentile(99);
+    stats.handler_p999_ns = latency.Percentile(99.9);
+    stats.handler_max_ns = latency.Max();
+    return stats;
+  }
+
+  // Add the distribution of the time spent in OnMessageArrive and the
+  // inline handlers, in nanoseconds, to latency.
+  void GetHandlerLatency(Histogram& latency) const {
+    metrics_.handler_latency.MergeInto(latency);
+  }
+
+  // Timing the handlers reads the clock twice per message. Without it the
+  // handler latency in GetStats stays empty. On by default.
+  void SetHandlerTiming(bool enabled) { time_handlers_ = enabled; }
+
+  // Write GetStats in the Prometheus text format to path, for example for
+  // the node_exporter textfile collector. The file is replaced atomically.
+  bool WriteMetrics(const std::string& path) const {
+    std::string temp_path = path + ".tmp";
+    {
+      std::ofstream file(temp_path, std::ios::trunc);
+      file << FormatPrometheus(GetStats());
+      if (!file) {
+        return false;
+      }
+    }
+    return std::rename(temp_path.c_str(), path.c_str()) == 0;
+  }
+
+  // Answer every HTTP request on 127.0.0.1:port with GetStats in the
+  // Prometheus text format. Runs on the first I/O thread, call after Start.
+  void ServeMetrics(uint16_t port) {
+    metrics_acceptor_ = std::make_unique<asio::ip::tcp::acceptor>(
+        context_pool_.GetContext(0),
+        asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), port));
+    AcceptMetricsScrape();
+  }
+
+  // O(1), nullptr if there is no such client (anymore)
+  std::shared_ptr<Connection<T>> GetClient(uint32_t id) const {
+    return connections_.Find(id);
   }
 
   // Send message to a specified client
-  void SendClient(std::shared_ptr<Connection<T>> client,
-                  const Message<T>& msg) {
+  SendStatus SendClient(std::shared_ptr<Connection<T>> client,
+                        const Message<T>& msg) {
+    if (client && client->IsConnected()) {
+      return client->Send(msg);
+    }
+    return SendStatus::kDropped;
+  }
+
+  // Send an already shared message to a specified client
+  SendStatus SendClient(std::shared_ptr<Connection<T>> client,
+                        const SharedMessage<T>& msg) {
     if (client && client->IsConnected()) {
-      client->Send(msg);
+      return client->Send(msg);
+    }
+    return SendStatus::kDropped;
+  }
+
+  // Answer a request a client sent with ClientInterface::Request, response
+  // goes to the handler or future of that request. A request without a
+  // correlation ID is answered like SendClient. When tracing, the write of
+  // response is recorded under the trace ID of request.
+  SendStatus Reply(std::shared_ptr<Connection<T>> client,
+                   const Message<T>& request, Message<T> response) {
+    if (request.correlation_id != 0) {
+      response.attach_correlation_id(request.correlation_id);
     }
+    if constexpr (kTracingEnabled) {
+      response.trace_id = request.trace_id;
+    }
+    return SendClient(client, MakeSharedMessage(std::move(response)));
   }
 
-  // Broadcast the message to all clients
+  // Broadcast the message to all clients, the body is copied only once
   void SendAllClient(const Message<T>& msg,
                      std::shared_ptr<Connection<T>> ignore_client = nullptr) {
-    for (auto& client : connections_) {
-      if (client && client->IsConnected()) {
-        if (client != ignore_client) {
-          client->Send(msg);
-        }
+    SendAllClient(MakeSharedMessage(msg), ignore_client);
+  }
+
+  // Broadcast a shared message to all clients, each client only takes a
+  // reference to it
+  void SendAllClient(const SharedMessage<T>& msg,
+                     std::shared_ptr<Connection<T>> ignore_client = nullptr) {
+    connections_.ForEach([&](const std::shared_ptr<Connection<T>>& client) {
+      if (client->IsConnected() && client != ignore_client) {
+        client->Send(msg);
       }
-    }
+    });
+  }
+
+  // Add client to the subscribers of topic, for example when
+  // OnMessageArrive gets a subscribe request from it. Subscriptions end with
+  // the connection. False if client already was a subscriber or has
+  // disconnected.
+  bool Subscribe(std::shared_ptr<Connection<T>> client,
+                 const std::string& topic) {
+    return client && topics_.Subscribe(client, topic);
+  }
+
+  bool Unsubscribe(std::shared_ptr<Connection<T>> client,
+                   const std::string& topic) {
+    return client && topics_.Unsubscribe(client->GetID(), topic);
+  }
+
+  // Send the message to the subscribers of topic only, return how many there
+  // were. The body is copied once, and large topics are fanned out by every
+  // I/O thread in parallel, each sending to the subscribers it runs.
+  size_t Publish(const std::string& topic, const Message<T>& msg) {
+    return topics_.Publish(topic, MakeSharedMessage(msg));
+  }
+
+  size_t Publish(const std::string& topic, const SharedMessage<T>& msg) {
+    return topics_.Publish(topic, msg);
   }
 
-  TsQueue<OwnedMessage<T>>& IncomingQueue() { return message_in_; }
+  // Below this many subscribers Publish sends on the calling thread,
+  // kDefaultPublishParallelThreshold by default.
+  void SetPublishParallelThreshold(size_t subscribers) {
+    topics_.SetParallelThreshold(subscribers);
+  }
+
+  IncomingMessageQueue<T>& IncomingQueue() { return message_in_; }
 
  protected:
   friend Connection<T>;
+  // Called on the client's I/O thread, like OnClientValidationSuccess.
+  // Returning false closes the connection.
   virtual bool OnClientConnect(std::shared_ptr<Connection<T>> client) {
     return false;
   }
@@ -141,18 +499,172 @@ class ServerInterface {
   virtual void OnClientDisconnect(std::shared_ptr<Connection<T>> client) {}
   virtual void OnMessageArrive(std::shared_ptr<Connection<T>> client,
                                Message<T>& message) {}
+  // Called on the client's I/O thread once its backpressured outgoing queue
+  // has drained to the low watermarks.
+  virtual void OnClientWritable(
+      std::shared_ptr<Connection<T>> /*client*/) {}
+  // Update hands every message it popped in one go to OnMessagesArrive.
+  // Override it to process the batch as a whole, by default each message is
+  // passed to OnMessageArrive in order.
+  virtual void OnMessagesArrive(std::vector<OwnedMessage<T>>& messages) {
+    for (auto& message : messages) {
+      TimeHandler([&]() { OnMessageArrive(message.remote, message.msg); });
+      if constexpr (kTracingEnabled) {
+        Trace(TracePoint::kHandled, message.trace_id);
+      }
+    }
+  }
+
+  // Run handler and record how long it took in GetHandlerLatency.
+  template <typename Handler>
+  void TimeHandler(Handler&& handler) {
+    if (!time_handlers_.load(std::memory_order_relaxed)) {
+      handler();
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    handler();
+    metrics_.handler_latency.Record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count());
+  }
+
+  void AcceptMetricsScrape() {
+    metrics_acceptor_->async_accept([this](system::error_code ec,
+                                           asio::ip::tcp::socket socket) {
+      if (ec == asio::error::operation_aborted) {
+        // the acceptor has been closed
+        return;
+      } else if (ec) {
+        // like too many open files, the next scrape may well succeed
+        std::cout << "[Server] Metrics Scrape Error:" << ec.message() << '\n';
+        AcceptMetricsScrape();
+        return;
+      }
+      auto scrape = std::make_shared<asio::ip::tcp::socket>(std::move(socket));
+      auto request = std::make_shared<asio::streambuf>();
+      asio::async_read_until(
+          *scrape, *request, "\r\n\r\n",
+          [this, scrape, request](system::error_code ec, std::size_t) {
+            if (ec) {
+              return;
+            }
+            std::string body = FormatPrometheus(GetStats());
+            auto response = std::make_shared<std::string>(
+                "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: " +
+                std::to_string(body.size()) + "\r\n\r\n" + body);
+            asio::async_write(
+                *scrape, asio::buffer(*response),
+                [scrape, response](system::error_code, std::size_t) {
+                  system::error_code ignored;
+                  scrape->shutdown(asio::ip::tcp::socket::shutdown_both,
+                                   ignored);
+                });
+          });
+      AcceptMetricsScrape();
+    });
+  }
+
+  // [Datagram thread] The client a datagram comes from, nullptr unless its
+  // token matches. O(1) for hellos too, whose sender does not know its ID
+  // yet, so unsolicited datagrams cannot make the server scan every client.
+  std::shared_ptr<Connection<T>> FindDatagramSender(
+      const DatagramHeader& header) const {
+    // 0 is never a token, see ConnectToClient
+    if (header.token == 0) {
+      return nullptr;
+    }
+    std::shared_ptr<Connection<T>> client;
+    {
+      std::unique_lock<std::mutex> lock(datagram_tokens_mux_);
+      auto it = datagram_tokens_.find(header.token);
+      if (it == datagram_tokens_.end()) {
+        return nullptr;
+      }
+      client = it->second.lock();
+    }
+    if (client && header.connection_id != kUnknownConnectionId &&
+        client->GetID() != header.connection_id) {
+      return nullptr;
+    }
+    return client;
+  }
+
+  // The wheel of the context that runs a connection.
+  TimingWheel* GetTimingWheel(asio::io_context& conn_context) {
+    for (size_t i = 0; i < context_pool_.size(); i++) {
+      if (&context_pool_.GetContext(i) == &conn_context) {
+        return timing_wheels_[i].get();
+      }
+    }
+    return nullptr;
+  }
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  void ListenOn(const std::string& path, bool shared_memory) {
+    std::remove(path.c_str());
+    local_listeners_.push_back(std::make_unique<LocalListener>(LocalListener{
+        asio::local::stream_protocol::acceptor(
+            context_pool_.GetContext(0),
+            asio::local::stream_protocol::endpoint(path)),
+        path}));
+    WaitForClientConnection(local_listeners_.back()->acceptor, shared_memory);
+  }
+#endif
 
  protected:
-  TsQueue<OwnedMessage<T>> message_in_;
+  // The contexts must be placed before the acceptor due to class
+  // initialization order, and before every member that may hold a connection
+  // (queued messages included) so that they outlive every connection socket.
+  ContextPool context_pool_;
+  // one per context, checking the timeouts of all of its connections
+  std::vector<std::unique_ptr<TimingWheel>> timing_wheels_;
 
-  std::vector<std::shared_ptr<Connection<T>>> connections_;
+  IncomingMessageQueue<T> message_in_;
+  // reused by Update for every batch it pops
+  std::vector<OwnedMessage<T>> update_batch_;
 
-  // asio_ontext must be placed before the acceptor due to class initialization
-  // order.
-  asio::io_context asio_context_;
-  std::thread thread_context_;
+  ConnectionRegistry<T> connections_;
+  // see Subscribe and Publish
+  TopicRegistry<T> topics_;
+  // IDs of connections that closed but are still in connections_
+  TsQueue<uint32_t> closed_ids_;
+  std::vector<uint32_t> closed_batch_;
 
   asio::ip::tcp::acceptor asio_acceptor_;
-  uint32_t id_counter_ = 10000;
+
+  // applied to every accepted connection
+  ConnectionOptions options_;
+  // ops handled on the I/O threads, read only once the server has started
+  DispatchTable<T> inline_handlers_;
+  // runs OnMessageArrive when StartWorkers was called, fed by Update
+  std::unique_ptr<WorkerPool<T>> workers_;
+
+  ServerMetrics metrics_;
+  // see Stop and Update
+  std::atomic<bool> stopped_{false};
+  // see SetHandlerTiming
+  std::atomic<bool> time_handlers_{true};
+  // held by RemoveClient while it folds a connection into metrics_
+  mutable std::mutex stats_mux_;
+  std::unique_ptr<asio::ip::tcp::acceptor> metrics_acceptor_;
+  // see ListenDatagrams
+  std::unique_ptr<DatagramChannel<T>> datagrams_;
+  // the connections by datagram token, filled once ConnectToClient has drawn
+  // it
+  mutable std::mutex datagram_tokens_mux_;
+  std::unordered_map<uint64_t, std::weak_ptr<Connection<T>>> datagram_tokens_;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  struct LocalListener {
+    asio::local::stream_protocol::acceptor acceptor;
+    std::string path;
+  };
+  // the acceptors of ListenLocal and ListenSharedMemory, Stop removes their
+  // socket files
+  std::vector<std::unique_ptr<LocalListener>> local_listeners_;
+#endif
 };
 }  // namespace net
\ No newline at end of file
@@ -0,0 +1,280 @@
+#pragma once
+#include "net_common.h"
+
+// Shared memory transport for processes on the same Linux host, see
+// ServerInterface::ListenSharedMemory. Elsewhere NET_HAS_SHARED_MEMORY stays
+// undefined and the transport is left out.
+#if defined(__linux__) && defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+#define NET_HAS_SHARED_MEMORY
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace net {
+// Control block of one direction, shared by both processes. Each index sits
+// on a cache line of its own so the two sides do not false share.
+struct SharedMemoryRingHeader {
+  // bytes ever written, only the writer stores it
+  alignas(64) std::atomic<uint64_t> head{0};
+  // bytes ever read, only the reader stores it
+  alignas(64) std::atomic<uint64_t> tail{0};
+  // set by a side that is about to sleep on its eventfd, cleared by the side
+  // that wakes it
+  alignas(64) std::atomic<uint32_t> reader_waiting{0};
+  std::atomic<uint32_t> writer_waiting{0};
+};
+
+// Single-producer single-consumer byte ring on top of a
+// SharedMemoryRingHeader. It carries the same byte stream a socket would,
+// frames may wrap around the end and be split over several writes. The peer
+// can store anything in the shared header, so each side keeps its own index
+// to itself and checks the peer's before using it; see IsCorrupt.
+class SharedMemoryRing {
+ public:
+  SharedMemoryRing() = default;
+  SharedMemoryRing(SharedMemoryRingHeader* header, uint8_t* data,
+                   size_t capacity)
+      : header_(header), data_(data), capacity_(capacity) {}
+
+  // Copy up to size bytes in, return how many fit.
+  size_t Write(const uint8_t* bytes, size_t size) {
+    uint64_t head = head_;
+    uint64_t tail = header_->tail.load(std::memory_order_acquire);
+    if (!CheckIndices(head, tail)) {
+      return 0;
+    }
+    size = std::min<size_t>(size, capacity_ - (head - tail));
+    if (size == 0) {
+      return 0;
+    }
+    size_t offset = head & (capacity_ - 1);
+    size_t first = std::min(size, capacity_ - offset);
+    std::memcpy(data_ + offset, bytes, first);
+    std::memcpy(data_, bytes + first, size - first);
+    head_ = head + size;
+    header_->head.store(head_, std::memory_order_release);
+    return size;
+  }
+
+  // Copy up to size bytes out, return how many there were.
+  size_t Read(uint8_t* bytes, size_t size) {
+    uint64_t tail = tail_;
+    uint64_t head = header_->head.load(std::memory_order_acquire);
+    if (!CheckIndices(head, tail)) {
+      return 0;
+    }
+    size = std::min<size_t>(size, head - tail);
+    if (size == 0) {
+      return 0;
+    }
+    size_t offset = tail & (capacity_ - 1);
+    size_t first = std::min(size, capacity_ - offset);
+    std::memcpy(bytes, data_ + offset, first);
+    std::memcpy(bytes + first, data_, size - first);
+    tail_ = tail + size;
+    header_->tail.store(tail_, std::memory_order_release);
+    return size;
+  }
+
+  // [Reader]
+  bool Empty() const {
+    return header_->head.load(std::memory_order_acquire) == tail_;
+  }
+
+  // [Writer] Also true for an out of bounds tail, the next Write reports it.
+  bool Full() const {
+    return head_ - header_->tail.load(std::memory_order_acquire) >= capacity_;
+  }
+
+  // True once the peer stored an index that puts more than capacity bytes
+  // in the ring (or a negative number). Write and Read then do nothing, the
+  // connection has to be closed.
+  bool IsCorrupt() const { return corrupt_; }
+
+  SharedMemoryRingHeader& GetHeader() { return *header_; }
+
+ private:
+  // Unsigned, so a wrapped index still gives the right distance and one
+  // moved the wrong way gives a huge one.
+  bool CheckIndices(uint64_t head, uint64_t tail) {
+    if (head - tail > capacity_) {
+      corrupt_ = true;
+    }
+    return !corrupt_;
+  }
+
+  SharedMemoryRingHeader* header_ = nullptr;
+  uint8_t* data_ = nullptr;
+  // a power of two
+  size_t capacity_ = 0;
+  // the index this side stores, only the writer uses head_ and only the
+  // reader tail_
+  uint64_t head_ = 0;
+  uint64_t tail_ = 0;
+  bool corrupt_ = false;
+};
+
+// The mapped region of one connection: a ring per direction and the two
+// eventfds the sides sleep on. The server creates it and passes the memfd and
+// the eventfds to the client over the Unix domain socket the connection was
+// accepted on.
+class SharedMemoryChannel {
+ public:
+  SharedMemoryChannel(const SharedMemoryChannel&) = delete;
+  SharedMemoryChannel& operator=(const SharedMemoryChannel&) = delete;
+  ~SharedMemoryChannel() {
+    if (region_ != nullptr) {
+      munmap(region_, region_size_);
+    }
+    for (int fd : {memory_fd_, own_event_fd_, peer_event_fd_}) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  // [Server] ring_bytes is rounded up to a power of two.
+  static std::unique_ptr<SharedMemoryChannel> Create(size_t ring_bytes,
+                                                     system::error_code& ec) {
+    size_t capacity = 4096;
+    while (capacity < ring_bytes) {
+      capacity *= 2;
+    }
+    std::unique_ptr<SharedMemoryChannel> channel(new SharedMemoryChannel());
+    channel->memory_fd_ =
+        memfd_create("net", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    channel->own_event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    channel->peer_event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    size_t size = 2 * sizeof(SharedMemoryRingHeader) + 2 * capacity;
+    if (channel->memory_fd_ < 0 || channel->own_event_fd_ < 0 ||
+        channel->peer_event_fd_ < 0 ||
+        ftruncate(channel->memory_fd_, static_cast<off_t>(size)) != 0 ||
+        // a client that shrank it would make the server fault on access
+        fcntl(channel->memory_fd_, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 ||
+        !channel->Map(size, true)) {
+      ec.assign(errno, system::system_category());
+      return nullptr;
+    }
+    return channel;
+  }
+
+  // [Server] Hand the memfd and the eventfds to the client, whose end of
+  // the Unix domain socket is socket.
+  bool SendTo(int socket, system::error_code& ec) const {
+    // the client sleeps on the server's peer eventfd and vice versa
+    int fds[3] = {memory_fd_, peer_event_fd_, own_event_fd_};
+    uint8_t tag = 'S';
+    iovec iov = {&tag, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(header), fds, sizeof(fds));
+    if (sendmsg(socket, &message, MSG_NOSIGNAL) != 1) {
+      ec.assign(errno, system::system_category());
+      return false;
+    }
+    return true;
+  }
+
+  // [Client] Take the descriptors SendTo sent, the socket must be readable.
+  static std::unique_ptr<SharedMemoryChannel> ReceiveFrom(
+      int socket, system::error_code& ec) {
+    int fds[3] = {-1, -1, -1};
+    uint8_t tag = 0;
+    iovec iov = {&tag, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (received != 1 || tag != 'S' || header == nullptr ||
+        header->cmsg_type != SCM_RIGHTS ||
+        header->cmsg_len != CMSG_LEN(sizeof(fds))) {
+      ec = received < 0 ? system::error_code(errno, system::system_category())
+                        : asio::error::make_error_code(
+                              asio::error::invalid_argument);
+      return nullptr;
+    }
+    std::memcpy(fds, CMSG_DATA(header), sizeof(fds));
+
+    std::unique_ptr<SharedMemoryChannel> channel(new SharedMemoryChannel());
+    channel->memory_fd_ = fds[0];
+    channel->own_event_fd_ = fds[1];
+    channel->peer_event_fd_ = fds[2];
+    off_t size = lseek(channel->memory_fd_, 0, SEEK_END);
+    if (size <= 0 || !channel->Map(static_cast<size_t>(size), false)) {
+      ec.assign(errno, system::system_category());
+      return nullptr;
+    }
+    return channel;
+  }
+
+  SharedMemoryRing& GetTx() { return tx_; }
+  SharedMemoryRing& GetRx() { return rx_; }
+
+  // The eventfd this side sleeps on. The caller takes it over.
+  int ReleaseOwnEventFd() { return std::exchange(own_event_fd_, -1); }
+
+  // Wake the other side.
+  void Notify() {
+    uint64_t one = 1;
+    // EAGAIN only means the counter is already non-zero
+    [[maybe_unused]] ssize_t written =
+        write(peer_event_fd_, &one, sizeof(one));
+  }
+
+ private:
+  SharedMemoryChannel() = default;
+
+  // Map the region and pick the rings, ring 0 carries server to client.
+  bool Map(size_t size, bool server) {
+    void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        memory_fd_, 0);
+    if (region == MAP_FAILED) {
+      return false;
+    }
+    region_ = region;
+    region_size_ = size;
+
+    auto* headers = static_cast<SharedMemoryRingHeader*>(region);
+    size_t capacity = (size - 2 * sizeof(SharedMemoryRingHeader)) / 2;
+    if (size < 2 * sizeof(SharedMemoryRingHeader) || capacity == 0 ||
+        (capacity & (capacity - 1)) != 0) {
+      errno = EINVAL;
+      return false;
+    }
+    if (server) {
+      new (&headers[0]) SharedMemoryRingHeader();
+      new (&headers[1]) SharedMemoryRingHeader();
+    }
+    auto* data = reinterpret_cast<uint8_t*>(headers + 2);
+    SharedMemoryRing to_client(&headers[0], data, capacity);
+    SharedMemoryRing to_server(&headers[1], data + capacity, capacity);
+    tx_ = server ? to_client : to_server;
+    rx_ = server ? to_server : to_client;
+    return true;
+  }
+
+  void* region_ = nullptr;
+  size_t region_size_ = 0;
+  int memory_fd_ = -1;
+  int own_event_fd_ = -1;
+  int peer_event_fd_ = -1;
+  SharedMemoryRing tx_;
+  SharedMemoryRing rx_;
+};
+}  // namespace net
+#endif
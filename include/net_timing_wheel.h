@@ -0,0 +1,116 @@
+#pragma once
+#include "net_common.h"
+
+namespace net {
+// Hashed timing wheel: a timer goes into the slot of the tick it expires on,
+// modulo the number of slots, and a single steady_timer advances the wheel
+// one slot per tick. Scheduling and expiring are O(1) however many timers
+// there are, at the cost of tick granularity, so every connection of an I/O
+// thread can keep its timeouts on the same wheel. Not thread-safe: only use
+// it on the thread that runs its io_context.
+class TimingWheel {
+ public:
+  using Callback = std::function<void()>;
+
+  TimingWheel(asio::io_context& asio_context,
+              std::chrono::milliseconds tick = std::chrono::milliseconds(100),
+              size_t slots = 512)
+      : timer_(asio_context),
+        tick_(std::max(tick, std::chrono::milliseconds(1))),
+        slots_(std::max<size_t>(slots, 1)),
+        start_(std::chrono::steady_clock::now()) {}
+  TimingWheel(const TimingWheel&) = delete;
+  TimingWheel& operator=(const TimingWheel&) = delete;
+
+  // Run callback ticks ticks from now, at least one. The wheel only ticks
+  // while it holds a timer.
+  void Schedule(uint64_t ticks, Callback callback) {
+    if (!running_) {
+      // it stood still while it was empty, skip the ticks it missed
+      tick_count_ = std::max<uint64_t>(tick_count_, ElapsedTicks());
+    }
+    uint64_t expiry = tick_count_ + std::max<uint64_t>(ticks, 1);
+    slots_[expiry % slots_.size()].push_back({expiry, std::move(callback)});
+    size_++;
+    if (!running_) {
+      running_ = true;
+      Wait();
+    }
+  }
+
+  // Ticks since the wheel was created, as of the last tick. Cheaper than
+  // reading the clock, which is what makes it fit for stamping activity.
+  uint64_t GetTick() const { return tick_count_; }
+
+  // The number of ticks that cover duration, rounded up.
+  uint64_t ToTicks(std::chrono::milliseconds duration) const {
+    return static_cast<uint64_t>((duration.count() + tick_.count() - 1) /
+                                 tick_.count());
+  }
+
+  std::chrono::milliseconds GetTickDuration() const { return tick_; }
+
+  // Timers that have not expired yet.
+  size_t size() const { return size_; }
+
+ private:
+  struct Entry {
+    uint64_t expiry = 0;
+    Callback callback;
+  };
+
+  uint64_t ElapsedTicks() const {
+    return static_cast<uint64_t>((std::chrono::steady_clock::now() - start_) /
+                                 tick_);
+  }
+
+  void Wait() {
+    // expiries are fixed points from start_, so ticks do not drift
+    timer_.expires_at(start_ + (tick_count_ + 1) * tick_);
+    timer_.async_wait([this](system::error_code ec) {
+      if (!ec) {
+        Advance();
+      }
+    });
+  }
+
+  // Visit every slot up to now, a late timer catches up tick by tick.
+  void Advance() {
+    uint64_t now = ElapsedTicks();
+    while (tick_count_ < now) {
+      tick_count_++;
+      // a slot also holds timers of later rounds, they stay
+      std::vector<Entry>& slot = slots_[tick_count_ % slots_.size()];
+      size_t kept = 0;
+      for (Entry& entry : slot) {
+        if (entry.expiry <= tick_count_) {
+          due_.push_back(std::move(entry));
+        } else {
+          slot[kept++] = std::move(entry);
+        }
+      }
+      slot.resize(kept);
+      size_ -= due_.size();
+      // callbacks may schedule again, always into a later tick
+      for (Entry& entry : due_) {
+        entry.callback();
+      }
+      due_.clear();
+    }
+    if (size_ > 0) {
+      Wait();
+    } else {
+      running_ = false;
+    }
+  }
+
+  asio::steady_timer timer_;
+  std::chrono::milliseconds tick_;
+  std::vector<std::vector<Entry>> slots_;
+  std::vector<Entry> due_;
+  std::chrono::steady_clock::time_point start_;
+  uint64_t tick_count_ = 0;
+  size_t size_ = 0;
+  bool running_ = false;
+};
+}  // namespace net
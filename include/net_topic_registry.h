@@ -0,0 +1,198 @@
+#pragma once
+#include <shared_mutex>
+#include <unordered_map>
+#include "net_common.h"
+#include "net_connection.h"
+#include "net_context_pool.h"
+
+namespace net {
+constexpr size_t kDefaultPublishParallelThreshold = 1024;
+
+// Index from topic to subscribed connections, and back from a connection to
+// its topics so a closed connection can be dropped from all of them at once.
+// Subscribers are grouped by the I/O context that runs them: Publish posts a
+// single task per context, which sends to the subscribers of that context on
+// their own thread. Topics with fewer than parallel_threshold subscribers are
+// served on the calling thread instead. Safe to use from any thread, Publish
+// only takes a shared lock.
+template <typename T>
+class TopicRegistry {
+ public:
+  TopicRegistry(ContextPool& context_pool,
+                size_t parallel_threshold = kDefaultPublishParallelThreshold)
+      : context_pool_(context_pool), parallel_threshold_(parallel_threshold) {}
+  TopicRegistry(const TopicRegistry<T>&) = delete;
+  TopicRegistry& operator=(const TopicRegistry<T>&) = delete;
+
+  // False if client already subscribed to topic or has been closed. The
+  // owner of the registry must call UnsubscribeAll once a connection closed.
+  bool Subscribe(const std::shared_ptr<Connection<T>>& client,
+                 const std::string& topic) {
+    std::unique_lock<std::shared_mutex> lock(mux_);
+    // checked under the lock, so a connection closing right now is either
+    // refused here or dropped by the UnsubscribeAll that follows its close
+    if (!client->IsConnected()) {
+      return false;
+    }
+    Topic& entry = topics_[topic];
+    if (entry.positions.count(client->GetID()) > 0) {
+      return false;
+    }
+    if (entry.by_context.empty()) {
+      entry.by_context.resize(context_pool_.size());
+    }
+    size_t context = GetContextIndex(*client);
+    auto& subscribers = entry.by_context[context];
+    entry.positions[client->GetID()] = {context, subscribers.size()};
+    subscribers.push_back(client);
+    entry.size++;
+    subscriptions_[client->GetID()].push_back(topic);
+    return true;
+  }
+
+  // False if client was not subscribed to topic.
+  bool Unsubscribe(uint32_t id, const std::string& topic) {
+    std::unique_lock<std::shared_mutex> lock(mux_);
+    if (!RemoveFromTopic(id, topic)) {
+      return false;
+    }
+    auto it = subscriptions_.find(id);
+    std::vector<std::string>& topics = it->second;
+    topics.erase(std::find(topics.begin(), topics.end(), topic));
+    if (topics.empty()) {
+      subscriptions_.erase(it);
+    }
+    return true;
+  }
+
+  // Drop id from every topic, O(topics of id).
+  void UnsubscribeAll(uint32_t id) {
+    std::unique_lock<std::shared_mutex> lock(mux_);
+    auto it = subscriptions_.find(id);
+    if (it == subscriptions_.end()) {
+      return;
+    }
+    for (const std::string& topic : it->second) {
+      RemoveFromTopic(id, topic);
+    }
+    subscriptions_.erase(it);
+  }
+
+  // Send msg to every connected subscriber of topic, return how many there
+  // were. The message is shared, not copied.
+  size_t Publish(const std::string& topic, const SharedMessage<T>& msg) {
+    std::shared_lock<std::shared_mutex> lock(mux_);
+    auto it = topics_.find(topic);
+    if (it == topics_.end()) {
+      return 0;
+    }
+    const Topic& entry = it->second;
+    if (entry.size < parallel_threshold_) {
+      for (const auto& subscribers : entry.by_context) {
+        SendAll(subscribers, msg);
+      }
+      return entry.size;
+    }
+    for (size_t i = 0; i < entry.by_context.size(); i++) {
+      if (entry.by_context[i].empty()) {
+        continue;
+      }
+      // the subscribers may change until the task runs, it looks the topic
+      // up again
+      asio::post(context_pool_.GetContext(i), [this, topic, msg, i]() {
+        std::shared_lock<std::shared_mutex> lock(mux_);
+        auto it = topics_.find(topic);
+        if (it != topics_.end()) {
+          SendAll(it->second.by_context[i], msg);
+        }
+      });
+    }
+    return entry.size;
+  }
+
+  // Topics with at least subscribers subscribers are fanned out in parallel.
+  void SetParallelThreshold(size_t subscribers) {
+    std::unique_lock<std::shared_mutex> lock(mux_);
+    parallel_threshold_ = subscribers;
+  }
+
+  size_t GetSubscriberCount(const std::string& topic) const {
+    std::shared_lock<std::shared_mutex> lock(mux_);
+    auto it = topics_.find(topic);
+    return it == topics_.end() ? 0 : it->second.size;
+  }
+
+  std::vector<std::string> GetTopics(uint32_t id) const {
+    std::shared_lock<std::shared_mutex> lock(mux_);
+    auto it = subscriptions_.find(id);
+    return it == subscriptions_.end() ? std::vector<std::string>()
+                                      : it->second;
+  }
+
+ private:
+  struct Position {
+    size_t context = 0;
+    size_t index = 0;
+  };
+
+  struct Topic {
+    // subscribers of each context of the pool, in no particular order
+    std::vector<std::vector<std::shared_ptr<Connection<T>>>> by_context;
+    // connection ID -> where it is in by_context
+    std::unordered_map<uint32_t, Position> positions;
+    size_t size = 0;
+  };
+
+  static void SendAll(
+      const std::vector<std::shared_ptr<Connection<T>>>& subscribers,
+      const SharedMessage<T>& msg) {
+    for (const auto& client : subscribers) {
+      if (client->IsConnected()) {
+        client->Send(msg);
+      }
+    }
+  }
+
+  size_t GetContextIndex(Connection<T>& client) const {
+    for (size_t i = 0; i < context_pool_.size(); i++) {
+      if (&context_pool_.GetContext(i) == &client.GetContext()) {
+        return i;
+      }
+    }
+    return 0;
+  }
+
+  // Swap-remove id from topic, drop the topic once it is empty. The caller
+  // holds the exclusive lock and updates subscriptions_.
+  bool RemoveFromTopic(uint32_t id, const std::string& topic) {
+    auto it = topics_.find(topic);
+    if (it == topics_.end()) {
+      return false;
+    }
+    Topic& entry = it->second;
+    auto position = entry.positions.find(id);
+    if (position == entry.positions.end()) {
+      return false;
+    }
+    auto [context, index] = position->second;
+    auto& subscribers = entry.by_context[context];
+    if (index + 1 != subscribers.size()) {
+      subscribers[index] = std::move(subscribers.back());
+      entry.positions[subscribers[index]->GetID()].index = index;
+    }
+    subscribers.pop_back();
+    entry.positions.erase(position);
+    if (--entry.size == 0) {
+      topics_.erase(it);
+    }
+    return true;
+  }
+
+  ContextPool& context_pool_;
+  size_t parallel_threshold_;
+  mutable std::shared_mutex mux_;
+  std::unordered_map<std::string, Topic> topics_;
+  // connection ID -> topics it subscribed to
+  std::unordered_map<uint32_t, std::vector<std::string>> subscriptions_;
+};
+}  // namespace net
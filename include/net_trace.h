@@ -0,0 +1,244 @@
+#pragma once
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include "net_common.h"
+
+namespace net {
+// Per-message tracing of the hot path, built only with NET_ENABLE_TRACING
+// (the CMake option of the same name). Every call site is wrapped in
+// if constexpr (kTracingEnabled), so without it the tracing code is not even
+// instantiated.
+#if defined(NET_ENABLE_TRACING)
+constexpr bool kTracingEnabled = true;
+#else
+constexpr bool kTracingEnabled = false;
+#endif
+
+enum class TracePoint : uint8_t {
+  // the header of an incoming frame has been read (or parsed out of the read
+  // buffer)
+  kHeaderRead,
+  // pushed to the incoming queue
+  kEnqueued,
+  // popped by Update
+  kDequeued,
+  // OnMessageArrive or an inline handler returned
+  kHandled,
+  // async_write of an outgoing message completed
+  kWritten,
+  // the same for a message that carries the trace ID of an incoming one (a
+  // Reply, or a received message sent on), recorded under that ID
+  kReplyWritten,
+};
+
+inline const char* ToString(TracePoint point) {
+  switch (point) {
+    case TracePoint::kHeaderRead:
+      return "header_read";
+    case TracePoint::kEnqueued:
+      return "enqueued";
+    case TracePoint::kDequeued:
+      return "dequeued";
+    case TracePoint::kHandled:
+      return "handled";
+    case TracePoint::kWritten:
+      return "written";
+    case TracePoint::kReplyWritten:
+      return "reply_written";
+    default:
+      return "unknown";
+  }
+}
+
+// Set in the trace ID of an outgoing message, which is numbered separately
+// from the incoming ones and must not land in their slices.
+constexpr uint64_t kOutgoingTraceBit = 1u << 31;
+constexpr uint64_t kTraceSequenceMask = kOutgoingTraceBit - 1;
+
+// The connection ID in the upper half, the sequence number of the incoming
+// message on that connection in the lower 31 bits.
+inline uint64_t MakeTraceId(uint32_t connection, uint64_t sequence) {
+  return (static_cast<uint64_t>(connection) << 32) |
+         (sequence & kTraceSequenceMask);
+}
+
+// The same for the outgoing message with that sequence number.
+inline uint64_t MakeOutgoingTraceId(uint32_t connection, uint64_t sequence) {
+  return MakeTraceId(connection, sequence) | kOutgoingTraceBit;
+}
+
+struct TraceEvent {
+  uint64_t time_ns = 0;
+  uint64_t trace_id = 0;
+  TracePoint point = TracePoint::kHeaderRead;
+};
+
+// Fixed-size ring of the latest events of one thread. Only its own thread
+// records, with plain relaxed stores and no lock; a reader may take a
+// snapshot at any time and skips the slots overwritten while it was copying.
+class TraceRing {
+ public:
+  static constexpr size_t kCapacity = 1 << 16;
+
+  explicit TraceRing(uint32_t thread_id) : thread_id_(thread_id) {}
+
+  void Record(TracePoint point, uint64_t trace_id) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    Slot& slot = slots_[head & (kCapacity - 1)];
+    slot.time_ns.store(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count(),
+        std::memory_order_relaxed);
+    slot.trace_id.store(trace_id, std::memory_order_relaxed);
+    slot.point.store(point, std::memory_order_relaxed);
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // Append the events still in the ring to events, oldest first.
+  void Snapshot(std::vector<TraceEvent>& events) const {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t begin = head > kCapacity ? head - kCapacity : 0;
+    size_t first = events.size();
+    for (uint64_t i = begin; i < head; i++) {
+      const Slot& slot = slots_[i & (kCapacity - 1)];
+      events.push_back({slot.time_ns.load(std::memory_order_relaxed),
+                        slot.trace_id.load(std::memory_order_relaxed),
+                        slot.point.load(std::memory_order_relaxed)});
+    }
+    // the writer may have lapped the oldest slots in the meantime
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t end = head_.load(std::memory_order_relaxed);
+    uint64_t valid = end > kCapacity ? end - kCapacity : 0;
+    if (valid > begin) {
+      size_t stale = static_cast<size_t>(std::min(valid, head) - begin);
+      events.erase(events.begin() + first, events.begin() + first + stale);
+    }
+  }
+
+  uint32_t GetThreadId() const { return thread_id_; }
+
+ private:
+  struct Slot {
+    std::atomic<uint64_t> time_ns{0};
+    std::atomic<uint64_t> trace_id{0};
+    std::atomic<TracePoint> point{TracePoint::kHeaderRead};
+  };
+
+  std::array<Slot, kCapacity> slots_;
+  std::atomic<uint64_t> head_{0};
+  uint32_t thread_id_;
+};
+
+// Owns the ring of every thread that ever recorded an event. Rings outlive
+// their threads, so the events of an I/O thread that has been stopped can
+// still be dumped.
+class Tracer {
+ public:
+  static Tracer& Instance() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  // The ring of the calling thread, created on first use.
+  TraceRing& LocalRing() {
+    thread_local TraceRing* ring = Register();
+    return *ring;
+  }
+
+  // Write everything still in the rings as a Chrome trace (JSON object
+  // format), which chrome://tracing and ui.perfetto.dev open. Every trace
+  // point is an instant event on the track of the thread that recorded it,
+  // and every incoming message also gets an async slice spanning from its
+  // first to its last trace point, the write of its reply included.
+  void WriteChromeTrace(std::ostream& out) const {
+    std::vector<std::pair<uint32_t, std::vector<TraceEvent>>> threads;
+    {
+      std::unique_lock<std::mutex> lock(mux_);
+      for (const auto& ring : rings_) {
+        threads.emplace_back(ring->GetThreadId(), std::vector<TraceEvent>());
+        ring->Snapshot(threads.back().second);
+      }
+    }
+
+    // first and last event of every incoming message
+    std::map<uint64_t, std::pair<uint64_t, uint64_t>> spans;
+    for (const auto& [tid, events] : threads) {
+      for (const TraceEvent& event : events) {
+        if (event.point == TracePoint::kWritten) {
+          continue;
+        }
+        auto [it, inserted] = spans.try_emplace(
+            event.trace_id, event.time_ns, event.time_ns);
+        if (!inserted) {
+          it->second.first = std::min(it->second.first, event.time_ns);
+          it->second.second = std::max(it->second.second, event.time_ns);
+        }
+      }
+    }
+
+    auto us = [](uint64_t ns) { return ns / 1000.0; };
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+    bool first = true;
+    auto separator = [&]() -> const char* {
+      bool was_first = first;
+      first = false;
+      return was_first ? "" : ",\n";
+    };
+    for (const auto& [tid, events] : threads) {
+      out << separator()
+          << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+          << ",\"args\":{\"name\":\"net " << tid << "\"}}";
+      for (const TraceEvent& event : events) {
+        out << separator() << "{\"name\":\"" << ToString(event.point)
+            << "\",\"cat\":\"net\",\"ph\":\"i\",\"s\":\"t\",\"ts\":"
+            << us(event.time_ns) << ",\"pid\":1,\"tid\":" << tid
+            << ",\"args\":{\"connection\":" << (event.trace_id >> 32)
+            << ",\"sequence\":" << (event.trace_id & kTraceSequenceMask)
+            << ",\"outgoing\":"
+            << ((event.trace_id & kOutgoingTraceBit) ? "true" : "false")
+            << "}}";
+      }
+    }
+    for (const auto& [trace_id, span] : spans) {
+      out << separator() << "{\"name\":\"message\",\"cat\":\"net\","
+          << "\"ph\":\"b\",\"id\":" << trace_id << ",\"ts\":" << us(span.first)
+          << ",\"pid\":1,\"tid\":0,\"args\":{\"connection\":"
+          << (trace_id >> 32)
+          << ",\"sequence\":" << (trace_id & kTraceSequenceMask) << "}}";
+      out << separator() << "{\"name\":\"message\",\"cat\":\"net\","
+          << "\"ph\":\"e\",\"id\":" << trace_id << ",\"ts\":" << us(span.second)
+          << ",\"pid\":1,\"tid\":0}";
+    }
+    out << "\n]}\n";
+  }
+
+  bool WriteChromeTrace(const std::string& path) const {
+    std::ofstream file(path, std::ios::trunc);
+    WriteChromeTrace(file);
+    return static_cast<bool>(file);
+  }
+
+ private:
+  Tracer() = default;
+
+  TraceRing* Register() {
+    std::unique_lock<std::mutex> lock(mux_);
+    rings_.push_back(
+        std::make_unique<TraceRing>(static_cast<uint32_t>(rings_.size())));
+    return rings_.back().get();
+  }
+
+  mutable std::mutex mux_;
+  std::vector<std::unique_ptr<TraceRing>> rings_;
+};
+
+// Record point for the message trace_id on the calling thread's ring.
+inline void Trace(TracePoint point, uint64_t trace_id) {
+  if constexpr (kTracingEnabled) {
+    Tracer::Instance().LocalRing().Record(point, trace_id);
+  }
+}
+}  // namespace net
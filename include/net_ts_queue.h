@@ -1,4 +1,5 @@
 #pragma once
+#include "net_buffer_pool.h"
 #include "net_common.h"
 namespace net {
 template <typename T>
@@ -25,6 +26,7 @@ class TsQueue {
   void push_front(const T& item) {
     std::unique_lock<std::mutex> lock(mux_);
     queue_.push_front(item);
+    lock.unlock();
 
     // unblock wait_until_non_empty
     std::unique_lock<std::mutex> ul(mux_blocking_);
@@ -34,6 +36,7 @@ class TsQueue {
   void push_front(T&& item) {
     std::unique_lock<std::mutex> lock(mux_);
     queue_.push_front(std::move(item));
+    lock.unlock();
 
     // unblock wait_until_non_empty
     std::unique_lock<std::mutex> ul(mux_blocking_);
@@ -43,6 +46,7 @@ class TsQueue {
   void push_back(const T& item) {
     std::unique_lock<std::mutex> lock(mux_);
     queue_.push_back(item);
+    lock.unlock();
 
     // unblock wait_until_non_empty
     std::unique_lock<std::mutex> ul(mux_blocking_);
@@ -52,6 +56,22 @@ class TsQueue {
   void push_back(T&& item) {
     std::unique_lock<std::mutex> lock(mux_);
     queue_.push_back(std::move(item));
+    lock.unlock();
+
+    // unblock wait_until_non_empty
+    std::unique_lock<std::mutex> ul(mux_blocking_);
+    cv_blocking_.notify_one();
+  }
+
+  // Move every item of items to the back of the queue under a single lock and
+  // leave items empty.
+  void push_batch(std::vector<T>& items) {
+    std::unique_lock<std::mutex> lock(mux_);
+    for (T& item : items) {
+      queue_.push_back(std::move(item));
+    }
+    items.clear();
+    lock.unlock();
 
     // unblock wait_until_non_empty
     std::unique_lock<std::mutex> ul(mux_blocking_);
@@ -65,6 +85,22 @@ class TsQueue {
     return result;
   }
 
+  // Move up to max_items items from the front of the queue to the back of out
+  // under a single lock, return how many were moved.
+  size_t pop_batch(std::vector<T>& out, size_t max_items) {
+    std::unique_lock<std::mutex> lock(mux_);
+    size_t count = std::min(max_items, queue_.size());
+    out.insert(out.end(), std::make_move_iterator(queue_.begin()),
+               std::make_move_iterator(queue_.begin() + count));
+    queue_.erase(queue_.begin(), queue_.begin() + count);
+    return count;
+  }
+
+  // Move every item to the back of out, return how many were moved.
+  size_t drain(std::vector<T>& out) {
+    return pop_batch(out, std::numeric_limits<size_t>::max());
+  }
+
   T pop_back() {
     std::unique_lock<std::mutex> lock(mux_);
     T result = std::move(queue_.back());
@@ -87,15 +123,29 @@ class TsQueue {
     queue_.clear();
   }
 
+  // The waiter holds mux_blocking_ while empty() takes mux_, so pushers must
+  // release mux_ before taking mux_blocking_ or the two can deadlock. Also
+  // returns, once, after wake.
   void wait_until_non_empty() {
     std::unique_lock<std::mutex> ul(mux_blocking_);
-    cv_blocking_.wait(ul, [this]() { return !empty(); });
+    cv_blocking_.wait(ul, [this]() { return woken_ || !empty(); });
+    woken_ = false;
+  }
+
+  // Make the current or the next wait_until_non_empty return even though
+  // nothing was pushed.
+  void wake() {
+    std::unique_lock<std::mutex> ul(mux_blocking_);
+    woken_ = true;
+    cv_blocking_.notify_one();
   }
 
  protected:
   std::condition_variable cv_blocking_;
   mutable std::mutex mux_blocking_;
+  // guarded by mux_blocking_
+  bool woken_ = false;
   mutable std::mutex mux_;
-  std::deque<T> queue_;
+  std::deque<T, PoolAllocator<T>> queue_;
 };
 }  // namespace net
\ No newline at end of file
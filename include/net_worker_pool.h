@@ -0,0 +1,256 @@
+#pragma once
+#include <condition_variable>
+#include <unordered_map>
+#include "net_common.h"
+#include "net_connection.h"
+#include "net_message.h"
+
+namespace net {
+struct WorkerPoolOptions {
+  // threads running the handler
+  size_t workers = std::max(1u, std::thread::hardware_concurrency());
+  // messages a worker handles for one connection before it moves on to the
+  // next connection in its run queue
+  size_t batch_per_turn = 32;
+  // messages submitted to a worker but not handled yet before Submit blocks,
+  // 0 means unbounded
+  size_t max_queued_per_worker = 0;
+};
+
+// Runs a handler for received messages on a pool of threads. Every
+// connection has a mailbox that at most one worker drains at a time, so the
+// messages of a connection are handled in the order they were submitted while
+// different connections are handled in parallel. A mailbox is scheduled on
+// worker ID % workers, idle workers steal whole mailboxes from the others.
+// Submit, SubmitBatch and Forget must be called from a single thread.
+template <typename T>
+class WorkerPool {
+ public:
+  using Handler = std::function<void(OwnedMessage<T>&)>;
+
+  WorkerPool(const WorkerPoolOptions& options, Handler handler)
+      : options_(options),
+        handler_(std::move(handler)),
+        workers_(std::max<size_t>(options.workers, 1)) {
+    options_.batch_per_turn = std::max<size_t>(options_.batch_per_turn, 1);
+    for (size_t i = 0; i < workers_.size(); i++) {
+      threads_.emplace_back([this, i]() { Run(i); });
+    }
+  }
+  WorkerPool(const WorkerPool<T>&) = delete;
+  WorkerPool& operator=(const WorkerPool<T>&) = delete;
+  ~WorkerPool() { Stop(); }
+
+  // Handle every message submitted so far, then join the workers.
+  void Stop() {
+    {
+      std::unique_lock<std::mutex> lock(idle_mux_);
+      stopping_ = true;
+    }
+    idle_cv_.notify_all();
+    for (auto& thread : threads_) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+    threads_.clear();
+  }
+
+  // Blocks while the worker the connection belongs to has
+  // max_queued_per_worker messages waiting.
+  void Submit(OwnedMessage<T>&& message) {
+    uint32_t id = message.remote->GetID();
+    std::shared_ptr<Mailbox>& mailbox = mailboxes_[id];
+    if (!mailbox) {
+      mailbox = std::make_shared<Mailbox>();
+      mailbox->home = id % workers_.size();
+      // a late message of a connection that was already forgotten
+      if (!message.remote->IsConnected()) {
+        retired_.push_back(id);
+      }
+    }
+
+    Worker& home = workers_[mailbox->home];
+    if (options_.max_queued_per_worker > 0) {
+      std::unique_lock<std::mutex> lock(space_mux_);
+      space_cv_.wait(lock, [&]() {
+        return home.queued.load() < options_.max_queued_per_worker;
+      });
+    }
+    home.queued++;
+
+    bool schedule = false;
+    {
+      std::unique_lock<std::mutex> lock(mailbox->mux);
+      mailbox->messages.push_back(std::move(message));
+      if (!mailbox->scheduled) {
+        mailbox->scheduled = schedule = true;
+      }
+    }
+    if (schedule) {
+      Schedule(mailbox, mailbox->home);
+    }
+  }
+
+  // Submit every message of messages in order and leave it empty.
+  void SubmitBatch(std::vector<OwnedMessage<T>>& messages) {
+    Sweep();
+    for (auto& message : messages) {
+      Submit(std::move(message));
+    }
+    messages.clear();
+  }
+
+  // The connection is gone, drop its mailbox once it has drained.
+  void Forget(uint32_t id) { retired_.push_back(id); }
+
+  size_t size() const { return workers_.size(); }
+
+ private:
+  struct Mailbox {
+    std::mutex mux;
+    std::deque<OwnedMessage<T>> messages;
+    // true while the mailbox sits in a run queue or a worker is draining it
+    bool scheduled = false;
+    size_t home = 0;
+  };
+
+  struct Worker {
+    std::mutex mux;
+    // the owner takes from the front, thieves from the back
+    std::deque<std::shared_ptr<Mailbox>> run_queue;
+    // messages of mailboxes homed here that are not handled yet
+    std::atomic<size_t> queued{0};
+    // messages taken for the current turn
+    std::vector<OwnedMessage<T>> turn;
+  };
+
+  void Schedule(const std::shared_ptr<Mailbox>& mailbox, size_t worker) {
+    {
+      std::unique_lock<std::mutex> lock(workers_[worker].mux);
+      workers_[worker].run_queue.push_back(mailbox);
+    }
+    runnable_++;
+    // pairs with the idle_workers_ increment in Run: either the worker sees
+    // runnable_ or we see it idle
+    if (idle_workers_.load() > 0) {
+      std::unique_lock<std::mutex> lock(idle_mux_);
+      idle_cv_.notify_one();
+    }
+  }
+
+  // Pop from the own run queue first, then steal from the others.
+  std::shared_ptr<Mailbox> Take(size_t index) {
+    for (size_t i = 0; i < workers_.size(); i++) {
+      Worker& worker = workers_[(index + i) % workers_.size()];
+      std::unique_lock<std::mutex> lock(worker.mux);
+      if (worker.run_queue.empty()) {
+        continue;
+      }
+      std::shared_ptr<Mailbox> mailbox;
+      if (i == 0) {
+        mailbox = std::move(worker.run_queue.front());
+        worker.run_queue.pop_front();
+      } else {
+        mailbox = std::move(worker.run_queue.back());
+        worker.run_queue.pop_back();
+      }
+      runnable_--;
+      return mailbox;
+    }
+    return nullptr;
+  }
+
+  void Run(size_t index) {
+    while (true) {
+      std::shared_ptr<Mailbox> mailbox = Take(index);
+      if (mailbox) {
+        RunTurn(index, mailbox);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(idle_mux_);
+      idle_workers_++;
+      idle_cv_.wait(lock, [this]() { return runnable_ > 0 || stopping_; });
+      idle_workers_--;
+      if (runnable_ == 0 && stopping_) {
+        return;
+      }
+    }
+  }
+
+  // Handle up to batch_per_turn messages of mailbox, then put it at the back
+  // of this worker's run queue if it still has some.
+  void RunTurn(size_t index, const std::shared_ptr<Mailbox>& mailbox) {
+    std::vector<OwnedMessage<T>>& turn = workers_[index].turn;
+    {
+      std::unique_lock<std::mutex> lock(mailbox->mux);
+      while (!mailbox->messages.empty() &&
+             turn.size() < options_.batch_per_turn) {
+        turn.push_back(std::move(mailbox->messages.front()));
+        mailbox->messages.pop_front();
+      }
+    }
+
+    for (auto& message : turn) {
+      handler_(message);
+    }
+    Release(workers_[mailbox->home], turn.size());
+    turn.clear();
+
+    {
+      std::unique_lock<std::mutex> lock(mailbox->mux);
+      if (mailbox->messages.empty()) {
+        mailbox->scheduled = false;
+        return;
+      }
+    }
+    Schedule(mailbox, index);
+  }
+
+  void Release(Worker& home, size_t count) {
+    home.queued -= count;
+    if (options_.max_queued_per_worker > 0) {
+      std::unique_lock<std::mutex> lock(space_mux_);
+      space_cv_.notify_all();
+    }
+  }
+
+  // Drop the mailboxes of forgotten connections that have drained.
+  void Sweep() {
+    for (size_t i = 0; i < retired_.size();) {
+      auto it = mailboxes_.find(retired_[i]);
+      if (it != mailboxes_.end()) {
+        std::unique_lock<std::mutex> lock(it->second->mux);
+        if (it->second->scheduled) {
+          i++;
+          continue;
+        }
+        lock.unlock();
+        mailboxes_.erase(it);
+      }
+      retired_[i] = retired_.back();
+      retired_.pop_back();
+    }
+  }
+
+  WorkerPoolOptions options_;
+  Handler handler_;
+  std::vector<Worker> workers_;
+  std::vector<std::thread> threads_;
+
+  // only touched by the submitting thread
+  std::unordered_map<uint32_t, std::shared_ptr<Mailbox>> mailboxes_;
+  std::vector<uint32_t> retired_;
+
+  // mailboxes sitting in run queues
+  std::atomic<size_t> runnable_{0};
+  std::atomic<size_t> idle_workers_{0};
+  std::mutex idle_mux_;
+  std::condition_variable idle_cv_;
+  bool stopping_ = false;
+
+  std::mutex space_mux_;
+  std::condition_variable space_cv_;
+};
+}  // namespace net
@@ -25,7 +25,7 @@ class ServerTest : public net::ServerInterface<Operation> {
       std::shared_ptr<net::Connection<Operation>> client) {
     net::Message<Operation> message(Operation::kRemotePrint);
     std::cout << "[Server] Allow Connection: "
-              << client->GetSocket().remote_endpoint() << '\n';
+              << client->RemoteEndpoint() << '\n';
     return true;
   }
   virtual void OnClientDisconnect(